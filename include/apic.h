@@ -0,0 +1,45 @@
+#ifndef APIC_H
+#define APIC_H
+#include <stdint.h>
+
+// Local APIC registers (byte offsets into the 4KB window)
+#define LAPIC_ID          0x020
+#define LAPIC_TPR         0x080
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0
+#define LAPIC_ICR_LOW     0x300
+#define LAPIC_ICR_HIGH    0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_CUR   0x390
+#define LAPIC_TIMER_DIV   0x3E0
+
+#define LAPIC_SVR_ENABLE   0x100
+#define LAPIC_LVT_MASKED   (1 << 16)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_ICR_PENDING  (1 << 12)
+#define LAPIC_ICR_INIT     0x00004500 // INIT, level assert
+#define LAPIC_ICR_STARTUP  0x00004600 // SIPI, vector = start page
+
+// Vectors of our own, above the 16 ISA IRQs at 32..47
+#define APIC_TIMER_VECTOR    48
+#define TLB_SHOOTDOWN_VECTOR 0xF0 // IPI: drop the TLB range in the current request
+#define TICKLESS_KICK_VECTOR 0xF1 // IPI to the boot CPU: cut its one-shot short
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// ACPI tables are read through this window (mapped as found)
+#define ACPI_WINDOW      0x60000000
+#define ACPI_WINDOW_SIZE (1024 * 1024)
+
+extern int apic_active;          // IRQs come through the IOAPIC, EOI goes to the LAPIC
+extern uint32_t lapic_timer_count; // LAPIC timer counts per scheduler tick
+
+int apic_init();
+void lapic_enable();
+void lapic_timer_start();
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t val);
+void irq_eoi();
+uint32_t apic_timer_handler(void* regs);
+#endif
@@ -0,0 +1,23 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+#include <stdint.h>
+
+/*
+ * Monotonic clock off the TSC, calibrated against PIT channel 2 at boot.
+ * Cycles go to nanoseconds as (cycles * mult) >> CLOCK_SHIFT, so reading
+ * the clock needs no division. Without a TSC it falls back to
+ * system_ticks, at tick resolution.
+ */
+#define CLOCK_SHIFT 22
+#define NS_PER_SEC  1000000000u
+#define NS_PER_MS   1000000u
+
+extern uint32_t tsc_khz; // 0 = no TSC, clock runs off ticks
+
+void clock_init();
+uint64_t clock_ns();
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+uint32_t clock_ns_to_ticks(uint64_t ns);
+uint64_t div64_32(uint64_t n, uint32_t d);
+void clock_print_stats();
+#endif
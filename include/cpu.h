@@ -0,0 +1,128 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// CPUID leaf 1, EDX feature bits
+#define CPU_FEATURE_FPU   (1 << 0)
+#define CPU_FEATURE_PSE   (1 << 3)
+#define CPU_FEATURE_TSC   (1 << 4)
+#define CPU_FEATURE_MSR   (1 << 5)
+#define CPU_FEATURE_APIC  (1 << 9)
+#define CPU_FEATURE_SEP   (1 << 11)
+#define CPU_FEATURE_MTRR  (1 << 12)
+#define CPU_FEATURE_PGE   (1 << 13)
+#define CPU_FEATURE_PAT   (1 << 16)
+#define CPU_FEATURE_FXSR  (1 << 24)
+#define CPU_FEATURE_SSE   (1 << 25)
+#define CPU_FEATURE_SSE2  (1 << 26)
+
+// Control register bits we care about
+#define CR0_MP  (1 << 1)
+#define CR0_EM  (1 << 2)
+#define CR0_TS  (1 << 3)
+#define CR0_WP  (1 << 16)
+#define CR0_CD  (1 << 30)
+#define CR0_NW  (1 << 29)
+#define CR4_PSE (1 << 4)
+#define CR4_OSFXSR     (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+// Model specific registers
+#define MSR_MTRRCAP        0x0FE
+#define MSR_SYSENTER_CS    0x174
+#define MSR_SYSENTER_ESP   0x175
+#define MSR_SYSENTER_EIP   0x176
+#define MSR_MTRR_PHYSBASE0 0x200 // PHYSBASEn = 0x200 + 2n, PHYSMASKn = 0x201 + 2n
+#define MSR_PAT            0x277
+#define MSR_MTRR_DEF_TYPE  0x2FF
+
+// Memory types (same encoding in PAT entries and MTRRs)
+#define MEMTYPE_UC 0x00
+#define MEMTYPE_WC 0x01
+#define MEMTYPE_WT 0x04
+#define MEMTYPE_WB 0x06
+
+// Variable-range MTRRs we copy between CPUs (real parts have 8-10)
+#define MTRR_MAX_VAR 16
+
+// One CPU's MTRR setup, so the APs can be made to match the boot CPU
+struct mtrr_state {
+    uint64_t def_type;
+    int count;
+    uint64_t base[MTRR_MAX_VAR];
+    uint64_t mask[MTRR_MAX_VAR];
+};
+
+extern uint32_t cpu_features_edx;
+extern uint32_t cpu_features_ecx;
+extern uint32_t cpu_signature;
+
+void cpu_init();
+int cpu_has(uint32_t edx_feature);
+int mtrr_set_wc(uint32_t base, uint32_t size);
+void mtrr_clear(int slot);
+int mtrr_save(struct mtrr_state* s);
+void mtrr_load(const struct mtrr_state* s);
+
+__attribute__((always_inline)) static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+__attribute__((always_inline)) static inline uint32_t read_cr0() {
+    uint32_t val;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(val));
+    return val;
+}
+
+__attribute__((always_inline)) static inline void write_cr0(uint32_t val) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(val) : "memory");
+}
+
+__attribute__((always_inline)) static inline uint32_t read_cr3() {
+    uint32_t val;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(val));
+    return val;
+}
+
+__attribute__((always_inline)) static inline uint32_t read_cr4() {
+    uint32_t val;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(val));
+    return val;
+}
+
+__attribute__((always_inline)) static inline void write_cr4(uint32_t val) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(val) : "memory");
+}
+
+__attribute__((always_inline)) static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+__attribute__((always_inline)) static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)) : "memory");
+}
+
+__attribute__((always_inline)) static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+__attribute__((always_inline)) static inline void wbinvd() {
+    __asm__ volatile("wbinvd" : : : "memory");
+}
+
+#define MAX_CPUS 8
+
+// Slot of the CPU we run on. GS is this CPU's cpu_local (see gdt_load_cpu),
+// whose first field is the slot, so valid from gdt_init on.
+// Only stable with interrupts off, a task can migrate otherwise.
+__attribute__((always_inline)) static inline int cpu_id() {
+    int id;
+    __asm__ volatile("movl %%gs:0, %0" : "=r"(id));
+    return id;
+}
+#endif
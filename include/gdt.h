@@ -1,6 +1,7 @@
 #ifndef GDT
 #define GDT
 #include <stdint.h>
+#include "cpu.h"
 
 struct gdt_entry {
     uint16_t limit_low;
@@ -16,6 +17,35 @@ struct gdt_ptr {
     uint32_t base;
 } __attribute__((packed));
 
+// 32-bit Task State Segment. We only use hardware task switching for the
+// page-fault handler, which needs a stack of its own (see gdt.c).
+struct tss_entry {
+    uint32_t prev_tss;
+    uint32_t esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+// Every CPU has a pair of TSS descriptors after the flat code/data ones:
+// where it parks whatever was running, and its own page-fault task
+#define GDT_CPU_TSS(cpu)   (0x18 + (cpu) * 16)
+#define GDT_CPU_FAULT(cpu) (0x20 + (cpu) * 16)
+#define GDT_KERNEL_TSS GDT_CPU_TSS(0)
+#define GDT_FAULT_TSS  GDT_CPU_FAULT(0)
+// Then one data segment per CPU whose base is its cpu_local; it lives in GS
+#define GDT_CPU_LOCAL(cpu) ((3 + 2 * MAX_CPUS + (cpu)) * 8)
+#define GDT_ENTRIES    (3 + 3 * MAX_CPUS)
+
+extern struct tss_entry cpu_tss[MAX_CPUS];
+// The parked context of the CPU we're on (the faulting one, in the fault task)
+#define kernel_tss (cpu_tss[cpu_id()])
+
 void gdt_init();
+void gdt_load_cpu(int cpu);
+void tss_set_cr3(uint32_t cr3);
 
 #endif // !GDT
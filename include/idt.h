@@ -2,9 +2,10 @@
 #define IDT
 
 #include <stdint.h>
-#define SYS_DRAW_CHAR 1
-#define SYS_GET_TICKS 2
-#define SYS_SLEEP     3
+#include "syscall.h"
+
+// yield(): reschedule only, no tick and no EOI (see yield_stub)
+#define YIELD_VECTOR  0x81
 
 // For the Assembler, we would define these as constants:
 // .define SYS_DRAW_CHAR 1
@@ -31,11 +32,11 @@ struct registers {
 };void idt_init();
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 void pic_remap(); 
-void timer_handler();
 void idt_init();
-void timer_handler();
+void idt_load_cpu(int cpu);
 void timer_init(uint32_t frequency);
 void keyboard_handler(struct registers *regs); 
+uint32_t timer_handler(struct registers *regs);
 void syscall_handler(struct registers *regs);
 void assemble_line(const char* line, uint8_t* out_buf, uint32_t* pos);
 void emit_mov(uint8_t reg_code, uint32_t val, uint8_t* out_buf, uint32_t* pos);
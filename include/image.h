@@ -0,0 +1,39 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+#include <stdint.h>
+#include "fat.h"
+
+// Every running program instance gets a window here; the pages of the
+// cached image are mapped into it read-only and copied on first write.
+#define IMAGE_REGION     0x50000000
+#define IMAGE_SLOT       (1024 * 1024) // Biggest program we can run
+#define IMAGE_INSTANCES  16
+#define IMAGE_REGION_END (IMAGE_REGION + IMAGE_INSTANCES * IMAGE_SLOT)
+// One-page windows for filling/copying frames (loader, fault task)
+#define IMAGE_SCRATCH_LOAD (IMAGE_REGION_END)
+#define IMAGE_SCRATCH_COW  (IMAGE_REGION_END + 4096)
+
+// Unreferenced images we keep around for the next RUN
+#define IMAGE_CACHE_MAX  8
+
+struct image {
+    // Identity of the file this was loaded from
+    uint16_t cluster;
+    uint16_t write_time;
+    uint16_t write_date;
+    uint32_t size;
+
+    uint32_t pages;
+    uint32_t* frames;   // Pristine copy, shared read-only by every instance
+    uint32_t refs;      // Instances mapping it
+    uint32_t cow_pages; // Private copies made so far (all instances)
+    int stale;          // File changed: not in the cache any more, dies with its last instance
+    struct image* next;
+};
+
+int image_spawn(struct fat_dir_entry* entry, char* name);
+void image_unmap(uint32_t base);
+int image_fault(uint32_t addr, uint32_t error_code);
+void image_invalidate(uint16_t cluster);
+void image_print_stats();
+#endif
@@ -13,8 +13,10 @@ extern int kbd_tail;
 int has_key_in_buffer();
 char get_key_from_buffer();
 void keyboard_push_char(char c);
-// Function to pull a char from the buffer
+// Blocking reads for the task with keyboard focus
 char keyboard_getchar();
+char keyboard_getchar_timeout(uint32_t ms);
+void keyboard_set_focus(int tid);
 // Must be in the header so every file can "paste" this assembly code
 __attribute__((always_inline)) static inline uint8_t inb(uint16_t port) {
     uint8_t ret;
@@ -0,0 +1,28 @@
+#ifndef KCACHE_H
+#define KCACHE_H
+#include <stdint.h>
+
+// Small requests are rounded up to one of these classes: 16, 32 ... 1024
+#define KCACHE_MIN_SHIFT  4
+#define KCACHE_CLASSES    7
+#define KCACHE_MAX_SIZE   (1 << (KCACHE_MIN_SHIFT + KCACHE_CLASSES - 1))
+
+// Objects per magazine; 14 makes a magazine exactly 64 bytes
+#define KCACHE_MAG_ROUNDS 14
+// Full magazines the depot holds per class before it drains to the heap
+#define KCACHE_DEPOT_MAX  4
+
+// Marks a heap block as owned by the magazine layer (low bits = class)
+#define KCACHE_TAG        0x4D414700
+#define KCACHE_CLASS_MASK 0xFF
+
+struct magazine {
+    struct magazine* next; // Depot list link
+    uint32_t rounds;       // Objects currently loaded
+    void* objs[KCACHE_MAG_ROUNDS];
+};
+
+void* kcache_alloc(uint32_t size, uint32_t caller);
+int kcache_free(void* ptr);
+void kcache_print_stats();
+#endif
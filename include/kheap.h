@@ -3,21 +3,49 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// Tag every block with the address that allocated it and the task that was
+// running (HEAPTOP). Build with -DKHEAP_TRACE=0 to get the 8 bytes back.
+#ifndef KHEAP_TRACE
+#define KHEAP_TRACE 1
+#endif
+
 // Every block of memory on the heap starts with this header
 typedef struct header {
     uint32_t size;   // Size of the block (excluding this header)
     uint32_t  is_free; // 1 if the block can be reused, 0 if it's taken
     struct header* next;
+    uint32_t cache_tag; // KCACHE_TAG | class for magazine objects, 0 otherwise
+#if KHEAP_TRACE
+    uint32_t caller; // Return address of whoever called kmalloc
+    uint32_t tid;    // Task that was running at the time
+#endif
 } __attribute__((packed)) header_t;
 
+// The heap starts with this much mapped and never trims below it
+#define KHEAP_MIN_SIZE   (64 * 1024)
+// Free tail space we tolerate before unmapping pages again
+#define KHEAP_TRIM_SLACK (256 * 1024)
+// Distinct call sites HEAPTOP keeps track of; the rest is lumped together
+#define KHEAP_TOP_SITES  32
+
+// Header of a block whose data starts exactly at ptr
+#define KHEAP_HEADER(ptr) ((header_t*)((uint32_t)(ptr) - sizeof(header_t)))
+
 void init_kheap();
 void* kmalloc(uint32_t size);
 void* kmalloc_a(uint32_t size); 
 void kfree(void* ptr);
+// The general-purpose list underneath the magazine caches
+void* kheap_alloc(uint32_t size, uint32_t caller);
+void kheap_free(void* ptr);
+uint32_t kheap_alloc_batch(uint32_t size, void** objs, uint32_t count, uint32_t tag);
+void kheap_free_batch(void** objs, uint32_t count);
+uint32_t kheap_block_tag(void* ptr);
 void* kmemcpy(void* dest, const void* src, uint32_t n);
 void* kmemcpy32(void* dest, const void* src, uint32_t n);
 void* kmemset(void* dest, uint32_t val, uint32_t n);
 void kheap_stats();
-void* kmemset(void* dest, uint32_t val, uint32_t n);
 void kheap_dump_map();
+void kheap_set_caller(void* ptr, void* caller);
+void kheap_top();
 #endif // !KHEAP
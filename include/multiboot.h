@@ -3,6 +3,13 @@
 
 #include <stdint.h>
 
+// Bits in multiboot_info.flags telling us which fields GRUB filled in
+#define MULTIBOOT_INFO_MEMORY   (1 << 0)  // mem_lower / mem_upper
+#define MULTIBOOT_INFO_MODS     (1 << 3)  // mods_count / mods_addr
+#define MULTIBOOT_INFO_MEM_MAP  (1 << 6)  // mmap_length / mmap_addr
+#define MULTIBOOT_INFO_FRAMEBUF (1 << 12) // framebuffer_*
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
 
 struct multiboot_info {
     uint32_t flags;
@@ -37,5 +44,21 @@ struct multiboot_info {
     uint32_t framebuffer_height;
     uint8_t  framebuffer_bpp;
     uint8_t  framebuffer_type;
-};
+} __attribute__((packed));
+
+// One entry of the BIOS (E820) memory map GRUB hands us.
+// 'size' does NOT count itself, so the next entry is at +size+4.
+struct multiboot_mmap_entry {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type; // 1 = usable RAM, everything else is off limits
+} __attribute__((packed));
+
+struct multiboot_module {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t cmdline;
+    uint32_t reserved;
+} __attribute__((packed));
 #endif // !MULTIBOOT
@@ -1,5 +1,57 @@
 #include <stdint.h>
 
+// Page table / directory entry bits
+#define PAGE_PRESENT  0x001
+#define PAGE_WRITE    0x002
+#define PAGE_USER     0x004
+#define PAGE_PWT      0x008
+#define PAGE_PCD      0x010
+#define PAGE_ACCESSED 0x020
+#define PAGE_DIRTY    0x040
+#define PAGE_PAT      0x080   // In a 4KB PTE
+#define PAGE_LARGE    0x080   // In a PDE: this entry is a 4MB page (PSE)
+#define PAGE_LARGE_PAT 0x1000 // PAT bit of a 4MB PDE
+
+// PDE 1023 maps the directory onto itself, so table N shows up at
+// PAGE_TABLES_VIRT + N * 4096. Nothing else may live in the top 4MB.
+#define PAGING_RECURSIVE_SLOT 1023
+#define PAGE_TABLES_VIRT      0xFFC00000
+
+// Range invalidations bigger than this become a single CR3 reload
+#define TLB_FLUSH_THRESHOLD 32
+
+struct tlb_flush_stats {
+    uint32_t page_flushes;  // Single invlpg
+    uint32_t range_flushes; // Batched invlpg loops
+    uint32_t range_pages;   // Pages covered by those loops
+    uint32_t full_flushes;  // CR3 reloads
+};
+extern struct tlb_flush_stats tlb_stats;
+
 void paging_init(); 
-void map_page(uint32_t virtual_addr, uint32_t physical_addr); 
+int paging_map(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
+void paging_unmap(uint32_t virtual_addr);
+int paging_protect(uint32_t virtual_addr, uint32_t flags);
+int paging_map_large(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
+int paging_map_range_large(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size, uint32_t flags);
+int paging_large_pages_enabled();
+int paging_map_range(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size, uint32_t flags);
+void paging_unmap_range(uint32_t virtual_addr, uint32_t size);
+int paging_protect_range(uint32_t virtual_addr, uint32_t size, uint32_t flags);
+uint32_t paging_get_entry(uint32_t virtual_addr);
+uint32_t paging_get_phys(uint32_t virtual_addr);
+int paging_set_write_combining(uint32_t virtual_addr, uint32_t size, int enable);
+int paging_pat_enabled();
+void paging_flush_page(uint32_t virtual_addr);
+void paging_flush_range(uint32_t virtual_addr, uint32_t pages);
+void paging_flush_local(uint32_t virtual_addr, uint32_t pages);
+void paging_print_stats();
+int map_page(uint32_t virtual_addr, uint32_t physical_addr); 
+void unmap_page(uint32_t virtual_addr);
 void flush_tlb(); 
+// paging_init identity-maps physical memory up to here
+#define KERNEL_IDENTITY_LIMIT (32 * 1024 * 1024)
+
+// Virtual window the kernel heap grows into (backed page by page from the PMM)
+#define KHEAP_START 0x10000000
+#define KHEAP_MAX   0x40000000
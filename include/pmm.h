@@ -1,4 +1,11 @@
+#include <stdint.h>
+#include "multiboot.h"
 void pmm_set_page(uint32_t page_addr); 
-void pmm_init(uint32_t mem_size, uint32_t bitmap_start); 
+void pmm_clear_page(uint32_t page_addr);
+void pmm_init(struct multiboot_info* mbi); 
 int pmm_find_free(); 
+int pmm_is_free(uint32_t page_addr);
 void* pmm_alloc_page(); 
+void pmm_free_page(void* page);
+uint32_t pmm_get_free_pages();
+uint32_t pmm_get_total_pages();
@@ -0,0 +1,27 @@
+#ifndef SCHED_H
+#define SCHED_H
+#include <stdint.h>
+
+// Ready queues, one per priority level; level 0 runs first
+#define SCHED_LEVELS           4
+#define SCHED_DEFAULT_PRIORITY 1
+// Every task goes back to its base level this often, so nothing starves
+#define SCHED_BOOST_TICKS      100
+
+struct task;
+
+void sched_init(int idle_tid);
+void sched_enqueue(int tid);
+void sched_dequeue(int tid);
+void sched_wake(int tid);
+void sched_sleep(uint32_t ticks);
+uint32_t sched_ms_to_ticks(uint32_t ms);
+void sched_tick(uint32_t ticks);
+void sched_boost(int tid);
+int sched_set_nice(int tid, uint32_t level);
+uint64_t sched_runtime_ns(struct task* t);
+uint32_t schedule(uint32_t esp);
+void schedule_tail();
+int sched_get_idle();
+int sched_is_idle(int tid);
+#endif
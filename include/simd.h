@@ -0,0 +1,25 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+
+// Below this the FXSAVE/FXRSTOR bracket costs more than SSE2 saves
+#define SIMD_MIN_BYTES 512
+// Above this we bypass the cache with non-temporal stores: the data is
+// bigger than L2 anyway (framebuffer flips, scrolls) and WC VRAM loves it
+#define SIMD_NT_BYTES  (256 * 1024)
+
+extern int simd_available;
+
+void simd_init();
+uint32_t kernel_fpu_begin();
+void kernel_fpu_end(uint32_t flags);
+void* simd_memcpy(void* dest, const void* src, uint32_t n);
+void* simd_memset32(void* dest, uint32_t val, uint32_t count);
+void simd_benchmark();
+
+struct task;
+void fpu_switch_out(struct task* prev);
+void fpu_trap();
+void fpu_print_stats();
+#endif
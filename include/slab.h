@@ -0,0 +1,41 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stdint.h>
+#include "spinlock.h"
+
+/*
+ * Fixed-size object caches. A slab is one SLAB_BYTES heap block carved
+ * into equal slots; every slot starts with a pointer back to its slab,
+ * so frees don't need the object size and the heap never sees them.
+ */
+#define SLAB_BYTES (16 * 1024)
+
+struct slab_cache;
+
+struct slab {
+    struct slab_cache* cache;
+    struct slab* next;   // partial/full list links
+    struct slab* prev;
+    void* free;          // Free objects, linked through their first word
+    uint32_t inuse;
+};
+
+struct slab_cache {
+    const char* name;
+    uint32_t obj_size;
+    uint32_t align;
+    uint32_t slot_size;  // Back pointer + object, rounded to 'align'
+    uint32_t per_slab;
+    struct slab* partial; // At least one free object
+    struct slab* full;
+    struct slab* spare;   // One empty slab kept around to absorb churn
+    uint32_t slabs;
+    uint32_t inuse;
+    spinlock_t lock;
+};
+
+void slab_cache_init(struct slab_cache* c, const char* name, uint32_t size, uint32_t align);
+void* slab_alloc(struct slab_cache* c);
+void slab_free(void* obj);
+void slab_print_stats(struct slab_cache* c);
+#endif
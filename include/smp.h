@@ -0,0 +1,46 @@
+#ifndef SMP_H
+#define SMP_H
+#include <stdint.h>
+#include "cpu.h"
+#include "spinlock.h"
+
+// Real-mode entry page for the APs; the SIPI vector is this >> 12
+#define AP_TRAMPOLINE  0x8000
+#define AP_STACK_SIZE  16384
+
+struct task;
+
+// What each CPU keeps to itself, indexed by cpu_id()
+struct cpu_local {
+    int id;                // First: cpu_id() reads it at %gs:0
+    uint32_t apic_id;
+    int online;
+    int tlb_ipi;           // Takes TLB shootdown IPIs (its IDT and LAPIC are up)
+    struct task* current;  // Running here right now
+    struct task* idle;     // Runs when nothing else can
+    struct task* prev;     // Just switched away from, still on_cpu until schedule_tail
+    uint32_t ticks;        // Scheduler ticks taken on this CPU
+    uint32_t steals;       // Tasks pulled over from other CPUs' queues
+    struct task* fpu_owner; // Its FPU/SSE state is live in this CPU's registers
+};
+
+extern struct cpu_local cpus[MAX_CPUS];
+extern int cpu_count;
+
+__attribute__((always_inline)) static inline struct cpu_local* this_cpu() {
+    return &cpus[cpu_id()];
+}
+
+// The running task: one load through GS, so we can't migrate mid-read
+__attribute__((always_inline)) static inline struct task* cpu_current() {
+    struct task* t;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(t) : "i"(__builtin_offsetof(struct cpu_local, current)));
+    return t;
+}
+
+void smp_init();
+void smp_tlb_shootdown(uint32_t virtual_addr, uint32_t pages);
+void smp_kick_boot_cpu();
+int smp_others_idle();
+void smp_print_stats();
+#endif
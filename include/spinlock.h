@@ -0,0 +1,60 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+#include <stdint.h>
+
+typedef volatile uint32_t spinlock_t;
+
+#define SPINLOCK_INIT 0
+
+// Interrupts off on this CPU; returns the old EFLAGS for irq_restore
+__attribute__((always_inline)) static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+__attribute__((always_inline)) static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+// Nonzero while a TLB shootdown waits for CPUs to ack (see smp.c)
+extern volatile uint32_t tlb_shootdown_mask;
+void tlb_shootdown_poll();
+
+__attribute__((always_inline)) static inline void spin_lock(spinlock_t* lock) {
+    while (__sync_lock_test_and_set(lock, 1)) {
+        // Spin on a plain read so we don't hammer the bus with locked xchg.
+        // We may be spinning with interrupts off on a lock held by a CPU
+        // that is itself waiting for our shootdown ack, so answer it here.
+        while (*lock) {
+            if (tlb_shootdown_mask) tlb_shootdown_poll();
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+// One attempt, no spinning: 1 if we got it
+__attribute__((always_inline)) static inline int spin_trylock(spinlock_t* lock) {
+    return !*lock && !__sync_lock_test_and_set(lock, 1);
+}
+
+__attribute__((always_inline)) static inline void spin_unlock(spinlock_t* lock) {
+    __sync_lock_release(lock);
+}
+
+/**
+ * The variant everything in the kernel should use: with interrupts off an
+ * IRQ handler (or the task switch it triggers) can never spin on a lock
+ * its own CPU is holding.
+ */
+__attribute__((always_inline)) static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+__attribute__((always_inline)) static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+#endif
@@ -0,0 +1,34 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+#include <stdint.h>
+
+// Syscall numbers go in EAX, arguments in EBX, ECX, EDX, ESI, EDI
+#define SYS_DRAW_CHAR 1
+#define SYS_GET_TICKS 2
+#define SYS_SLEEP     3
+#define SYS_EXIT      4
+#define SYS_CLEAR     5
+#define SYS_DRAW_RECT 6
+#define SYS_TIME_NS   7 // Monotonic ns since boot, low half in eax, high in edx
+#define SYSCALL_COUNT 8
+
+/*
+ * The registers a syscall sees, in the order sysenter_entry pushes them.
+ * Handlers leave results in eax (and edx for 64-bit ones).
+ */
+struct syscall_args {
+    uint32_t eax, ebx, ecx, edx, esi, edi;
+};
+
+// Fast path caller sequence, 12 bytes and position independent:
+//     call 1f / jmp 2f / 1: push ebp / mov ebp, esp / sysenter / 2:
+// sysenter_entry returns with a plain ret to the jmp, which skips the rest.
+#define SYSENTER_CALL_BYTES { 0xE8, 0x02, 0x00, 0x00, 0x00, 0xEB, 0x05, 0x55, 0x89, 0xE5, 0x0F, 0x34 }
+
+extern int sysenter_available;
+
+void syscall_init_cpu(int cpu);
+void syscall_dispatch(struct syscall_args* args);
+void emit_syscall(uint8_t* out_buf, uint32_t* pos);
+void syscall_print_stats();
+#endif
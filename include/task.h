@@ -1,14 +1,30 @@
 #ifndef TASK_H
 #define TASK_H
 #include <stdint.h>
+#include "timer.h"
+#include "smp.h"
+#include "wait.h"
 
-#define MAX_TASKS 10
-#define STACK_SIZE 4096
+// task.state values
+#define TASK_EMPTY    0
+#define TASK_READY    1
+#define TASK_SLEEPING 2
+#define TASK_ZOMBIE   3 // Exited, stack not released yet
+
+// Every task gets a slot of this window for its stack: an unmapped guard
+// page at the bottom, the rest committed page by page as it grows down.
+#define TASK_STACK_REGION 0x40000000
+#define TASK_STACK_SLOT   (64 * 1024)
+#define TASK_STACK_GUARD  4096
+
+// A tid is also its stack slot, so the window up to IMAGE_REGION caps them
+#define TASK_PID_MAX      4096
+#define TASK_HASH_SIZE    256
 
 struct task {
     uint32_t esp;
     uint32_t state; // 0 = empty, 1 = ready, 2 = sleep 
-    uint32_t sleep_ticks;
+    struct timer sleep_timer; // Wakes the task out of SLEEPING
     char name[16];
     uint32_t vga_index; // Store the character position (0-3999)
     int last_x; // Track the X coordinate used in syscall
@@ -16,16 +32,59 @@ struct task {
     int first_x; // Track the Y coordinate used in syscall
     int first_y; // Track the Y coordinate used in syscall
     int has_drawn; // Boolean flag: did this task ever print?
-    void* stack_ptr; // Store this so we can kfree it!
+    uint32_t stack_pages; // Stack pages committed so far
     void* code_ptr;  // Store this so we can kfree it!
     uint32_t total_ticks; // Accumulated CPU time
+    // Scheduler (sched.c)
+    int tid;
+    uint32_t priority;         // Ready queue level, 0 runs first
+    uint32_t base_priority;    // NICE level: where boosts put it back
+    uint32_t slice_left;       // Ticks left in the current quantum
+    uint32_t allotment_used;   // Ticks spent at this level, demoted when it runs out
+    int yielding;              // Gave the CPU up itself (int 0x81 from yield())
+    int queued;                // On a ready queue right now
+    int cpu;                   // Whose ready queue it goes back to
+    int on_cpu;                // Some CPU is still on its stack
+    volatile int kill_pending; // Killed while on a CPU; becomes ZOMBIE when it leaves it
+    int pins;                  // task_pin/task_iter holders; the reaper leaves it alone
+    // Accounting, in clock_ns() time, updated on every switch (sched.c)
+    uint64_t run_ns;           // Time actually on a CPU
+    uint64_t wait_ns;          // Time READY on a ready queue, waiting for one
+    uint64_t exec_start;       // Got the CPU at
+    uint64_t queued_at;        // Went on the ready queue at
+    uint32_t nvcsw;            // Gave the CPU up: slept, blocked, yielded, exited
+    uint32_t nivcsw;           // Had it taken away: quantum ran out, or preempted
+    uint64_t top_run_ns;       // TOP's previous sample, for the rates
+    uint32_t top_switches;
+    // Lazy FPU (simd.c): loaded on #NM, saved when it's switched out
+    int fpu_used;              // Has FPU state of its own in fpu_state
+    uint8_t fpu_state[512] __attribute__((aligned(16))); // FXSAVE image
+    // Wait queues (wait.c)
+    struct wait_queue* waiting_on; // Queue it is blocked on, if any
+    struct task* wait_next;
+    struct task* wait_prev;
+    struct task* rq_next;      // Ready queue links
+    struct task* rq_prev;
+    // Task table (task.c)
+    struct task* hash_next;    // tid hash chain
+    struct task* all_next;     // Every live task, in spawn order
+    struct task* all_prev;
 };
 
+// Whatever the calling CPU is running
+#define current_task     (cpu_current())
+#define current_task_idx (get_current_task_id())
+
 void init_multitasking();
 void idle_task_code();
 void yield();
 int get_current_task_id();
+struct task* task_find(int id);
+struct task* task_pin(int id);
+void task_unpin(struct task* t);
+struct task* task_iter(struct task* prev);
 int spawn_task(void (*entry_point)(), void* code_ptr, char* name);
+struct task* task_adopt(char* name, int tid);
 void kill_task(int id);
 uint32_t task_get_esp(int id);
 int task_is_ready(int id);
@@ -37,4 +96,13 @@ int task_get_total_ticks(int id);
 void task_timer();
 void task_game();
 void run_top();
+uint32_t task_stack_top(int id);
+int task_stack_fault(uint32_t addr);
+void task_stack_release(int id);
+int task_get_stack_pages(int id);
+int task_get_priority(int id);
+void task_release_code(int id);
+void task_make_zombie(struct task* t);
+int task_count();
+void task_print_stats();
 #endif
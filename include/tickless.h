@@ -0,0 +1,20 @@
+#ifndef TICKLESS_H
+#define TICKLESS_H
+#include <stdint.h>
+
+/*
+ * Tickless idle: while only the idle task can run, the PIT is switched
+ * from its periodic mode to a one-shot that fires when the timer wheel
+ * next has work. Channel 0 counts down 16 bits at 1.193182 MHz, so one
+ * shot covers at most ~55ms.
+ */
+#define PIT_HZ 1193182
+
+extern int tickless_enabled;
+
+void tickless_enter();
+int tickless_active();
+uint32_t tickless_sync();
+void tickless_kick();
+void tickless_print_stats();
+#endif
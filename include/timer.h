@@ -0,0 +1,31 @@
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel: 256 one-tick slots, then four levels of 64
+ * slots each covering 64x the range of the level below. A tick only
+ * touches the slot that expires (plus an occasional cascade), no matter
+ * how many timers are armed.
+ */
+#define TIMER_ROOT_BITS  8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_ROOT_SIZE  (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+
+struct timer {
+    uint32_t expires;         // Absolute tick (system_ticks) it fires on
+    void (*fn)(void* arg);    // Runs from the timer IRQ, interrupts off
+    void* arg;
+    struct timer* next;       // Wheel slot links
+    struct timer* prev;
+    int pending;
+};
+
+void timer_setup(struct timer* t, void (*fn)(void* arg), void* arg);
+void timer_add(struct timer* t, uint32_t ticks);
+int timer_cancel(struct timer* t);
+uint32_t timer_remaining(struct timer* t);
+void timer_tick(uint32_t now);
+uint32_t timer_idle_ticks(uint32_t max);
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "font.h"
+#include "multiboot.h"
 // Format: 0xRRGGBB
 #define COLOR_BLACK   0x000000
 #define COLOR_WHITE   0xFFFFFF
@@ -17,41 +18,6 @@
 extern int vesa_cursor_x;
 extern int vesa_cursor_y;
 
-struct multiboot_info {
-    uint32_t flags;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
-    uint32_t boot_device;
-    uint32_t cmdline;
-    uint32_t mods_count;
-    uint32_t mods_addr;
-    uint32_t num;
-    uint32_t size;
-    uint32_t addr;
-    uint32_t shndx;
-    uint32_t mmap_length;
-    uint32_t mmap_addr;
-    uint32_t drives_length;
-    uint32_t drives_addr;
-    uint32_t config_table;
-    uint32_t boot_loader_name;
-    uint32_t apm_table;
-    uint32_t vbe_control_info;
-    uint32_t vbe_mode_info;
-    uint16_t vbe_mode;
-    uint16_t vbe_interface_seg;
-    uint16_t vbe_interface_off;
-    uint16_t vbe_interface_len;
-
-    // These are the important ones for graphics:
-    uint64_t framebuffer_addr;
-    uint32_t framebuffer_pitch;
-    uint32_t framebuffer_width;
-    uint32_t framebuffer_height;
-    uint8_t  framebuffer_bpp;
-    uint8_t  framebuffer_type;
-}__attribute__((packed));
-
 void VESA_print_at(const char* str, int x, int y, uint32_t color);
 void VESA_init(struct multiboot_info* mbi);
 void VESA_putpixel(int x, int y, uint32_t color);
@@ -69,5 +35,8 @@ struct multiboot_info* VESA_get_boot_info();
 void VESA_set_fps(uint32_t fps);
 void VESA_print_at(const char* str, int x, int y, uint32_t color);
 void VESA_clear_region(int x, int y, int w, int h);
+int VESA_set_write_combining(int enable);
+int VESA_get_write_combining();
+uint32_t VESA_time_flip(int rounds);
 void kputc(char c);
 #endif // !VESA_H
@@ -0,0 +1,36 @@
+#ifndef WAIT_H
+#define WAIT_H
+#include <stdint.h>
+#include "spinlock.h"
+
+struct task;
+
+/*
+ * Tasks blocked until some event, linked through task->wait_next. A task
+ * is on at most one queue at a time. The usual loop:
+ *
+ *     while (1) {
+ *         wait_prepare(&wq);        // SLEEPING and queued
+ *         if (condition) break;
+ *         yield();                  // Off the CPU until a wake_up
+ *     }
+ *     wait_finish(&wq);             // READY, off the queue
+ *
+ * Queuing before the check means a wake_up that lands in between turns
+ * the yield into a plain reschedule instead of a lost wakeup.
+ */
+struct wait_queue {
+    spinlock_t lock;
+    struct task* head;
+    struct task* tail;
+};
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, 0, 0 }
+
+void wait_queue_init(struct wait_queue* wq);
+void wait_prepare(struct wait_queue* wq);
+void wait_finish(struct wait_queue* wq);
+void wait_remove(struct task* t);
+int wake_up(struct wait_queue* wq);
+int wake_up_tid(struct wait_queue* wq, int tid);
+#endif
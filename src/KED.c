@@ -8,12 +8,12 @@
 extern int vesa_updating;
 extern int keyboard_focus_tid;
 extern uint32_t system_ticks;
-extern int current_task_idx;
+extern uint32_t timer_frequency;
 
 void run_editor(const char* filename) {
     // 1. Setup focus and memory
     int previous_focus = keyboard_focus_tid;
-    keyboard_focus_tid = current_task_idx;
+    keyboard_set_focus(current_task_idx);
     
     // Allocate 4KB for the editor buffer
     char* text_buffer = (char*)kmalloc(4096);
@@ -56,9 +56,9 @@ void run_editor(const char* filename) {
         vesa_updating = 0;
         VESA_flip();
 
-        // 3. Handle Input
-        if (has_key_in_buffer()) {
-            char c = get_key_from_buffer();
+        // 3. Handle Input: sleep until a key, or until the cursor blinks
+        char c = keyboard_getchar_timeout(20 * 1000 / timer_frequency);
+        if (c) {
 
             if (c == 17) { // Ctrl + Q
                 break;
@@ -88,10 +88,9 @@ void run_editor(const char* filename) {
                 }
             }
         }
-        yield(); // Let the Spinner keep spinning!
     }
 
     kfree(text_buffer);
-    keyboard_focus_tid = previous_focus;
+    keyboard_set_focus(previous_focus);
     VESA_clear();
 }
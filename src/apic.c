@@ -0,0 +1,305 @@
+#include "apic.h"
+#include "smp.h"
+#include "cpu.h"
+#include "paging.h"
+#include "io.h"
+#include "lib.h"
+#include "sched.h"
+#include "task.h"
+#include <stddef.h>
+
+/*
+ * Local APIC + IOAPIC, found through the ACPI MADT. Until apic_init has
+ * run (or if there is no MADT) the 8259 PIC keeps delivering IRQs to the
+ * boot CPU and irq_eoi talks to it instead.
+ */
+
+static volatile uint32_t* lapic = NULL;
+int apic_active = 0;
+uint32_t lapic_timer_count = 0;
+
+static volatile uint32_t* ioapic = NULL;
+static uint32_t acpi_window_used = 0;
+
+extern volatile uint32_t system_ticks;
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_rsdp {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+} __attribute__((packed));
+
+struct madt {
+    struct acpi_header h;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} __attribute__((packed));
+
+// ISA IRQ -> IOAPIC input, from MADT interrupt source overrides
+static uint32_t isa_gsi[16];
+static uint16_t isa_flags[16];
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4] = val;
+    (void)lapic[LAPIC_ID / 4]; // Read back so the write has landed
+}
+
+static void ioapic_write(uint32_t reg, uint32_t val) {
+    ioapic[0] = reg;
+    ioapic[4] = val; // IOWIN at +0x10
+}
+
+// Uncached identity mapping for an MMIO page (PCD|PWT = PAT entry 3, UC)
+static void map_mmio(uint32_t phys) {
+    uint32_t page = phys & ~0xFFF;
+    if (!(paging_get_entry(page) & PAGE_PRESENT)) {
+        paging_map(page, page, PAGE_WRITE | PAGE_PCD | PAGE_PWT);
+    }
+}
+
+// Maps [phys, +len) into the ACPI window, returns where it can be read
+static void* acpi_map(uint32_t phys, uint32_t len) {
+    uint32_t first = phys & ~0xFFF;
+    uint32_t pages = ((phys + len + 0xFFF) & ~0xFFF) - first;
+    if (acpi_window_used + pages > ACPI_WINDOW_SIZE) return NULL;
+
+    uint32_t virt = ACPI_WINDOW + acpi_window_used;
+    for (uint32_t off = 0; off < pages; off += 4096) {
+        if (paging_map(virt + off, first + off, 0) != 0) return NULL;
+    }
+    acpi_window_used += pages;
+    return (void*)(virt + (phys & 0xFFF));
+}
+
+static int checksum_ok(const void* p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += ((const uint8_t*)p)[i];
+    return sum == 0;
+}
+
+// The RSDP sits on a 16-byte boundary in the EBDA or the BIOS ROM area
+static struct acpi_rsdp* find_rsdp() {
+    uint32_t ebda;
+    __asm__("movzwl 0x40E, %0" : "=r"(ebda)); // BDA: EBDA segment (GCC won't deref a constant address quietly)
+    ebda <<= 4;
+    uint32_t ranges[2][2] = { { ebda, ebda + 1024 }, { 0xE0000, 0x100000 } };
+    for (int r = 0; r < 2; r++) {
+        if (!ranges[r][0]) continue;
+        for (uint32_t p = ranges[r][0]; p < ranges[r][1]; p += 16) {
+            if (kstrncmp((const char*)p, "RSD PTR ", 8) == 0 && checksum_ok((void*)p, 20)) {
+                return (struct acpi_rsdp*)p;
+            }
+        }
+    }
+    return NULL;
+}
+
+static struct madt* find_madt() {
+    struct acpi_rsdp* rsdp = find_rsdp();
+    if (!rsdp) return NULL;
+
+    struct acpi_header* rsdt = acpi_map(rsdp->rsdt_addr, sizeof(struct acpi_header));
+    if (!rsdt) return NULL;
+    rsdt = acpi_map(rsdp->rsdt_addr, rsdt->length);
+    if (!rsdt || !checksum_ok(rsdt, rsdt->length)) return NULL;
+
+    uint32_t entries = (rsdt->length - sizeof(struct acpi_header)) / 4;
+    uint32_t* tables = (uint32_t*)(rsdt + 1);
+    for (uint32_t i = 0; i < entries; i++) {
+        struct acpi_header* h = acpi_map(tables[i], sizeof(struct acpi_header));
+        if (!h || kstrncmp(h->signature, "APIC", 4) != 0) continue;
+        h = acpi_map(tables[i], h->length);
+        if (h && checksum_ok(h, h->length)) return (struct madt*)h;
+    }
+    return NULL;
+}
+
+/**
+ * Walks the MADT: one CPU slot per enabled local APIC (the boot CPU is
+ * always slot 0), the first IOAPIC, and the ISA overrides. Returns the
+ * number of CPUs, 0 if there is nothing to work with.
+ */
+static int parse_madt(struct madt* m, uint32_t* ioapic_phys) {
+    uint32_t bsp_apic = lapic_read(LAPIC_ID) >> 24;
+    cpus[0].apic_id = bsp_apic;
+    int count = 1;
+
+    for (int i = 0; i < 16; i++) {
+        isa_gsi[i] = i;
+        isa_flags[i] = 0;
+    }
+
+    uint8_t* p = (uint8_t*)(m + 1);
+    uint8_t* end = (uint8_t*)m + m->h.length;
+    while (p + 2 <= end && p[1] >= 2) {
+        switch (p[0]) {
+            case 0: { // Processor local APIC: acpi id, apic id, flags
+                uint32_t apic_id = p[3];
+                uint32_t flags = *(uint32_t*)(p + 4);
+                if ((flags & 1) && apic_id != bsp_apic && count < MAX_CPUS) {
+                    cpus[count].apic_id = apic_id;
+                    count++;
+                }
+                break;
+            }
+            case 1: // IOAPIC: id, reserved, address, GSI base
+                if (!*ioapic_phys) *ioapic_phys = *(uint32_t*)(p + 4);
+                break;
+            case 2: { // Interrupt source override: bus, irq, gsi, flags
+                uint8_t irq = p[3];
+                if (irq < 16) {
+                    isa_gsi[irq] = *(uint32_t*)(p + 4);
+                    isa_flags[irq] = *(uint16_t*)(p + 8);
+                }
+                break;
+            }
+        }
+        p += p[1];
+    }
+
+    for (int i = 0; i < count; i++) cpus[i].id = i;
+    return count;
+}
+
+// Sends an ISA IRQ to 'vector' on the boot CPU
+static void ioapic_route(int irq, uint32_t vector) {
+    uint32_t gsi = isa_gsi[irq];
+    uint32_t low = vector;
+    if ((isa_flags[irq] & 0x3) == 0x3) low |= 1 << 13;  // Active low
+    if ((isa_flags[irq] & 0xC) == 0xC) low |= 1 << 15;  // Level triggered
+    ioapic_write(0x10 + 2 * gsi + 1, cpus[0].apic_id << 24);
+    ioapic_write(0x10 + 2 * gsi, low);
+}
+
+// Bit 16 of the redirection entry: the IOAPIC drops the IRQ
+static void ioapic_mask(int irq) {
+    ioapic_write(0x10 + 2 * isa_gsi[irq], 1 << 16);
+}
+
+void lapic_enable() {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+// Waits for the next PIT tick; 0 if it never came (IRQ routing is broken)
+static int wait_tick() {
+    uint32_t start = system_ticks;
+    for (uint32_t spins = 0; spins < 100000000; spins++) {
+        if (system_ticks != start) return 1;
+        __asm__ volatile("pause");
+    }
+    return 0;
+}
+
+/**
+ * How many LAPIC timer counts (divide by 16) fit in one PIT tick. Needs
+ * interrupts on and the PIT running; takes two ticks. 0 on timeout.
+ */
+static uint32_t lapic_calibrate() {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    if (!wait_tick()) return 0;
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    if (!wait_tick()) return 0;
+    uint32_t count = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    return count;
+}
+
+// Periodic scheduler tick for an AP (the boot CPU keeps the PIT)
+void lapic_timer_start() {
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) __asm__ volatile("pause");
+}
+
+void irq_eoi() {
+    if (apic_active) lapic_write(LAPIC_EOI, 0);
+    else outb(0x20, 0x20);
+}
+
+/**
+ * Maps the local APIC and, if the MADT lists one, moves the timer and
+ * keyboard from the 8259 over to the IOAPIC. Returns how many CPUs the
+ * MADT knows about, 0 if we stay on the PIC.
+ */
+int apic_init() {
+    if (!cpu_has(CPU_FEATURE_APIC) || !cpu_has(CPU_FEATURE_MSR)) return 0;
+
+    struct madt* m = find_madt();
+    if (!m) return 0;
+
+    uint32_t base = m->lapic_addr;
+    map_mmio(base);
+    lapic = (volatile uint32_t*)base;
+
+    uint32_t ioapic_phys = 0;
+    int count = parse_madt(m, &ioapic_phys);
+    lapic_enable();
+    if (!ioapic_phys) return count;
+
+    map_mmio(ioapic_phys);
+    ioapic = (volatile uint32_t*)ioapic_phys;
+
+    // Swap controllers with interrupts off: mask the 8259, route 0 and 1
+    uint32_t flags = irq_save();
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+    ioapic_route(0, 32);
+    ioapic_route(1, 33);
+    apic_active = 1;
+    irq_restore(flags);
+
+    lapic_timer_count = lapic_calibrate();
+    if (!lapic_timer_count) {
+        // The PIT never showed up through the IOAPIC: back to the 8259, one CPU.
+        // Mask both routes first or each IRQ would arrive twice.
+        flags = irq_save();
+        ioapic_mask(0);
+        ioapic_mask(1);
+        apic_active = 0;
+        outb(0x21, 0xFC);
+        outb(0xA1, 0xFF);
+        irq_restore(flags);
+        return 0;
+    }
+    return count;
+}
+
+/**
+ * LAPIC timer interrupt on an AP: charge the tick, pick who runs next.
+ * Returns the stack to switch to, 0 to stay.
+ */
+uint32_t apic_timer_handler(void* regs) {
+    struct cpu_local* cpu = this_cpu();
+    cpu->ticks++;
+    if (cpu->current->state != TASK_EMPTY) cpu->current->total_ticks++;
+    sched_tick(1);
+    lapic_write(LAPIC_EOI, 0);
+    return schedule((uint32_t)regs);
+}
@@ -1,8 +1,8 @@
 section .multiboot
 align 4
     dd 0x1BADB002             ; magic
-    dd 0x00000005             ; flags (Align modules + Graphics)
-    dd -(0x1BADB002 + 0x00000005)
+    dd 0x00000007             ; flags (Align modules + Memory map + Graphics)
+    dd -(0x1BADB002 + 0x00000007)
 
     ; Graphics parameters
     dd 0, 0, 0, 0, 0
@@ -0,0 +1,103 @@
+#include "clock.h"
+#include "cpu.h"
+#include "io.h"
+#include "idt.h"
+#include "lib.h"
+#include "tickless.h"
+
+uint32_t tsc_khz = 0;
+static uint64_t tsc_boot = 0;   // TSC at calibration, clock_ns() counts from here
+static uint32_t ns_mult = 0;    // ns = (cycles * ns_mult) >> CLOCK_SHIFT
+
+extern volatile uint32_t system_ticks;
+
+// Calibration window: 10ms of PIT channel 2
+#define CALIBRATE_COUNTS (PIT_HZ / 100)
+#define CALIBRATE_RUNS   3
+// Port reads before we give up on OUT2. A read takes ~1us, the countdown
+// 10ms, so this is far past anything a working channel 2 needs.
+#define CALIBRATE_MAX_POLLS 1000000
+
+/**
+ * 64 by 32 bit division without libgcc: the high half first, then divl
+ * on the remainder and the low half (which can't overflow since r < d).
+ */
+uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t q_lo;
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "0"(lo), "1"(r), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+/**
+ * TSC cycles across one mode 0 countdown of channel 2 (the speaker
+ * channel, gated through port 0x61), so channel 0 and its IRQ stay as
+ * they are. OUT2 shows up as bit 5 of port 0x61. Returns 0 if it never
+ * does (no channel 2 gate on this machine, or a hypervisor that leaves it out).
+ */
+static uint32_t pit_ch2_cycles(uint32_t counts) {
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01); // Gate on, speaker off
+    outb(0x43, 0xB0);                       // Channel 2, lo/hi byte, mode 0
+    outb(0x42, (uint8_t)(counts & 0xFF));
+    outb(0x42, (uint8_t)((counts >> 8) & 0xFF));
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t polls = 0; !(inb(0x61) & 0x20); polls++) {
+        if (polls >= CALIBRATE_MAX_POLLS) return 0;
+    }
+    return (uint32_t)(rdtsc() - t0);
+}
+
+void clock_init() {
+    if (!cpu_has(CPU_FEATURE_TSC)) return;
+
+    // 1. Shortest of a few runs: an SMI or a slow port read only ever adds
+    uint32_t best = 0xFFFFFFFF;
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        uint32_t c = pit_ch2_cycles(CALIBRATE_COUNTS);
+        if (c == 0) return; // Timed out: no TSC clock, tsc_khz stays 0
+        if (c < best) best = c;
+    }
+    if (best == 0 || best == 0xFFFFFFFF) return;
+
+    // 2. cycles / (counts / PIT_HZ) seconds, in kHz
+    uint32_t khz = (uint32_t)div64_32((uint64_t)best * PIT_HZ, CALIBRATE_COUNTS * 1000);
+    if (khz < 1000) return; // Under 1MHz is a broken TSC, not a slow CPU
+
+    // 3. ns per cycle = 10^6 / khz, as a fixed-point multiplier
+    ns_mult = (uint32_t)div64_32((uint64_t)1000000 << CLOCK_SHIFT, khz);
+    tsc_boot = rdtsc();
+    tsc_khz = khz;
+}
+
+// 64x32 multiply split in halves so the intermediate never needs 96 bits
+uint64_t clock_cycles_to_ns(uint64_t cycles) {
+    uint64_t lo = ((uint64_t)(uint32_t)cycles * ns_mult) >> CLOCK_SHIFT;
+    uint64_t hi = ((uint64_t)(uint32_t)(cycles >> 32) * ns_mult) << (32 - CLOCK_SHIFT);
+    return lo + hi;
+}
+
+/**
+ * Nanoseconds since boot. The APs come out of the same reset as the boot
+ * CPU, so their TSCs are taken to be in step with it.
+ */
+uint64_t clock_ns() {
+    if (!tsc_khz) return (uint64_t)system_ticks * (NS_PER_SEC / timer_frequency);
+    return clock_cycles_to_ns(rdtsc() - tsc_boot);
+}
+
+// Whole timer ticks covering 'ns', rounded up
+uint32_t clock_ns_to_ticks(uint64_t ns) {
+    uint32_t ns_per_tick = NS_PER_SEC / timer_frequency;
+    uint64_t ticks = div64_32(ns + ns_per_tick - 1, ns_per_tick);
+    if (ticks > 0xFFFFFFFF) return 0xFFFFFFFF;
+    return ticks ? (uint32_t)ticks : 1;
+}
+
+void clock_print_stats() {
+    if (tsc_khz) kprintf_unsync("Clock: TSC at %d kHz\n", tsc_khz);
+    else kprintf_unsync("Clock: no TSC, %d Hz ticks\n", timer_frequency);
+}
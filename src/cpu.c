@@ -0,0 +1,138 @@
+#include "cpu.h"
+
+uint32_t cpu_features_edx = 0;
+uint32_t cpu_features_ecx = 0;
+uint32_t cpu_signature = 0; // Leaf 1 EAX: stepping, model, family
+
+/**
+ * Reads CPUID leaf 1 once so the rest of the kernel can ask cheaply.
+ * Every CPU we could boot on (i586+) has CPUID, so no EFLAGS.ID dance.
+ */
+void cpu_init() {
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    if (a < 1) return; // No feature leaf at all
+
+    cpuid(1, &a, &b, &c, &d);
+    cpu_signature = a;
+    cpu_features_edx = d;
+    cpu_features_ecx = c;
+}
+
+int cpu_has(uint32_t edx_feature) {
+    return (cpu_features_edx & edx_feature) != 0;
+}
+
+/**
+ * Brackets an MTRR update the way the SDM wants it: caches off and
+ * flushed, MTRRs disabled while we edit, then everything back on.
+ */
+static uint32_t mtrr_begin(uint64_t* def_type) {
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags));
+
+    write_cr0((read_cr0() | CR0_CD) & ~CR0_NW);
+    wbinvd();
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+
+    *def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+    wrmsr(MSR_MTRR_DEF_TYPE, *def_type & ~(1 << 11)); // MTRRs off
+    return flags;
+}
+
+static void mtrr_end(uint64_t def_type, uint32_t flags) {
+    wbinvd();
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    wrmsr(MSR_MTRR_DEF_TYPE, def_type);
+    write_cr0(read_cr0() & ~(CR0_CD | CR0_NW));
+    __asm__ volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+/**
+ * MAXPHYADDR from CPUID 0x80000008, or 36 (what PAE-era parts without
+ * that leaf implement) when it isn't there.
+ */
+static uint32_t phys_addr_bits() {
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, &a, &b, &c, &d);
+    if (a < 0x80000008) return 36;
+    cpuid(0x80000008, &a, &b, &c, &d);
+    a &= 0xFF;
+    return (a >= 32 && a <= 52) ? a : 36;
+}
+
+/**
+ * Fallback for CPUs without PAT: claim a free variable-range MTRR and make
+ * [base, base + size) write-combining. MTRR ranges must be a power of two
+ * and aligned to their size, so size is rounded up and base must fit.
+ * Returns the slot used, or -1.
+ */
+int mtrr_set_wc(uint32_t base, uint32_t size) {
+    if (!cpu_has(CPU_FEATURE_MTRR) || !cpu_has(CPU_FEATURE_MSR)) return -1;
+
+    uint64_t cap = rdmsr(MSR_MTRRCAP);
+    if (!(cap & (1 << 10))) return -1; // No WC support in the MTRRs
+
+    uint32_t range = 4096;
+    while (range < size && range < 0x80000000) range <<= 1;
+    if (range < size || (base & (range - 1))) return -1;
+
+    uint64_t phys_mask = (1ULL << phys_addr_bits()) - 1;
+    int count = cap & 0xFF;
+    for (int slot = 0; slot < count; slot++) {
+        uint64_t mask = rdmsr(MSR_MTRR_PHYSBASE0 + 2 * slot + 1);
+        if (mask & (1 << 11)) continue; // In use
+
+        uint64_t def_type;
+        uint32_t flags = mtrr_begin(&def_type);
+        wrmsr(MSR_MTRR_PHYSBASE0 + 2 * slot, (uint64_t)base | MEMTYPE_WC);
+        // The mask covers bits 12..MAXPHYADDR-1; setting reserved bits above it #GPs
+        wrmsr(MSR_MTRR_PHYSBASE0 + 2 * slot + 1, (phys_mask & ~(uint64_t)(range - 1) & ~0xFFFULL) | (1 << 11));
+        mtrr_end(def_type, flags);
+        return slot;
+    }
+    return -1;
+}
+
+void mtrr_clear(int slot) {
+    if (slot < 0) return;
+
+    uint64_t def_type;
+    uint32_t flags = mtrr_begin(&def_type);
+    wrmsr(MSR_MTRR_PHYSBASE0 + 2 * slot + 1, 0);
+    mtrr_end(def_type, flags);
+}
+
+/**
+ * Snapshots this CPU's variable-range MTRRs. Returns 0 (and leaves 's'
+ * empty) if there are none to copy.
+ */
+int mtrr_save(struct mtrr_state* s) {
+    s->count = 0;
+    if (!cpu_has(CPU_FEATURE_MTRR) || !cpu_has(CPU_FEATURE_MSR)) return 0;
+
+    int count = rdmsr(MSR_MTRRCAP) & 0xFF;
+    if (count > MTRR_MAX_VAR) count = MTRR_MAX_VAR;
+    s->def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+    for (int slot = 0; slot < count; slot++) {
+        s->base[slot] = rdmsr(MSR_MTRR_PHYSBASE0 + 2 * slot);
+        s->mask[slot] = rdmsr(MSR_MTRR_PHYSBASE0 + 2 * slot + 1);
+    }
+    s->count = count;
+    return count;
+}
+
+// Programs this CPU's variable-range MTRRs to match a mtrr_save snapshot
+void mtrr_load(const struct mtrr_state* s) {
+    if (!s->count) return;
+
+    uint64_t def_type;
+    uint32_t flags = mtrr_begin(&def_type);
+    for (int slot = 0; slot < s->count; slot++) {
+        wrmsr(MSR_MTRR_PHYSBASE0 + 2 * slot, s->base[slot]);
+        wrmsr(MSR_MTRR_PHYSBASE0 + 2 * slot + 1, s->mask[slot]);
+    }
+    mtrr_end(s->def_type, flags);
+}
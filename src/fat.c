@@ -4,6 +4,7 @@
 #include "io.h"
 #include "lib.h"
 #include "vesa.h"
+#include "image.h"
 
 static struct fat_bpb bpb;
 static uint32_t root_dir_sectors;
@@ -133,12 +134,8 @@ void fat_init() {
     first_fat_sector = bpb.reserved_sector_count;
     uint32_t first_root_dir_sector = first_fat_sector + (bpb.num_fats * bpb.fat_size_16);
     first_data_sector = first_root_dir_sector + root_dir_sectors;
-header_t* tail = (header_t*)0xB00218; // The address of your B2
-tail->size = (16 * 1024 * 1024) - ((uint32_t)tail - 0x800000) - sizeof(header_t);
-tail->is_free = 1;
-tail->next = NULL;
 
-fat_touch("SPINNER.BIN");
+    fat_touch("SPINNER.BIN");
     fat_write_file_raw("SPINNER.BIN", (const uint8_t*)spinner_code, sizeof(spinner_code));
     //kprintf_color(0x00FF00, "SPINNER.BIN created successfully!\n");
     
@@ -161,6 +158,7 @@ void* fat_load_file(struct fat_dir_entry* entry) {
     uint32_t alloc_size = ((entry->size + 511) / 512) * 512;
     uint8_t* buffer = (uint8_t*)kmalloc(alloc_size);
     if (!buffer) return NULL;
+    kheap_set_caller(buffer, __builtin_return_address(0)); // Whoever loads it owns it
 
     uint16_t cluster = entry->first_cluster_low;
     uint32_t bytes_remaining = entry->size;
@@ -722,6 +720,7 @@ void fat_write_file(const char* filename, const char* data) {
     // 3. Update Directory Entry Size immediately
     entries[slot].size = total_size;
     ide_write_sector(dir_lba, global_fat_buf);
+    image_invalidate(current_cluster); // We don't keep mtime up to date
 
     // 4. The Write Loop
     uint32_t bytes_written = 0;
@@ -775,6 +774,7 @@ void fat_rm(const char* filename) {
 
             // 1. Free the cluster chain in the FAT table
             uint16_t cluster = entries[i].first_cluster_low;
+            image_invalidate(cluster);
             while (cluster != 0 && cluster < 0xFFF8) {
                 uint16_t next = fat_get_next_cluster(cluster);
                 fat_update_table(cluster, 0x0000); // 0x0000 = Free
@@ -1053,6 +1053,7 @@ void fat_write_file_raw(const char* filename, const unsigned char* data, size_t
     // 3. Update Size and Commit Directory Entry
     entries[slot].size = total_size;
     ide_write_sector(dir_lba, dir_buf);
+    image_invalidate(current_cluster); // We don't keep mtime up to date
     
     // We are done with the directory buffer, free it now to keep heap clean
     kfree(dir_buf);
@@ -1,10 +1,18 @@
 #include "gdt.h"
+#include "smp.h"
 
-struct gdt_entry gdt[3];
+struct gdt_entry gdt[GDT_ENTRIES];
 struct gdt_ptr gp;
 
+// On a task switch each CPU saves the outgoing context here...
+struct tss_entry cpu_tss[MAX_CPUS];
+// ...and loads its page-fault handler's context from here
+static struct tss_entry fault_tss[MAX_CPUS];
+static uint8_t fault_stack[MAX_CPUS][16384] __attribute__((aligned(16)));
+
 // Assembly function to apply the GDT
 extern void gdt_flush(uint32_t);
+extern void page_fault_task();
 
 void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     gdt[num].base_low    = (base & 0xFFFF);
@@ -18,13 +26,54 @@ void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_
     gdt[num].access      = access;
 }
 
+/**
+ * A #PF on a task stack that ran into an uncommitted page can't be handled
+ * on that same stack: pushing the exception frame would fault again and
+ * escalate to a triple fault. So IDT 14 is a task gate and the handler
+ * runs as its own task with fault_stack.
+ */
+static void fault_tss_init(int cpu) {
+    struct tss_entry* f = &fault_tss[cpu];
+    f->esp = (uint32_t)fault_stack[cpu] + sizeof(fault_stack[cpu]);
+    f->ss = 0x10;
+    f->eip = (uint32_t)page_fault_task;
+    f->eflags = 0x2; // Interrupts off while we fiddle with page tables
+    f->cs = 0x08;
+    f->ds = f->es = f->fs = 0x10;
+    f->gs = GDT_CPU_LOCAL(cpu); // cpu_id() works in the fault task too
+    f->iomap_base = sizeof(struct tss_entry);
+    cpu_tss[cpu].iomap_base = sizeof(struct tss_entry);
+}
+
 void gdt_init() {
-    gp.limit = (sizeof(struct gdt_entry) * 3) - 1;
+    gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
     gp.base  = (uint32_t)&gdt;
 
     gdt_set_gate(0, 0, 0, 0, 0);                // Null segment
     gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Code segment (0x08)
     gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment (0x10)
+    // TSS pairs for every CPU slot, whether or not it ever comes up
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        fault_tss_init(cpu);
+        gdt_set_gate(3 + 2 * cpu, (uint32_t)&cpu_tss[cpu], sizeof(struct tss_entry) - 1, 0x89, 0x00);
+        gdt_set_gate(4 + 2 * cpu, (uint32_t)&fault_tss[cpu], sizeof(struct tss_entry) - 1, 0x89, 0x00);
+        gdt_set_gate(GDT_CPU_LOCAL(cpu) / 8, (uint32_t)&cpus[cpu], sizeof(struct cpu_local) - 1, 0x92, 0x40);
+    }
 
+    gdt_load_cpu(0);
+}
+
+// Each CPU loads the shared GDT, marks its own TSS busy and points GS at its cpu_local
+void gdt_load_cpu(int cpu) {
     gdt_flush((uint32_t)&gp);
+    __asm__ volatile("ltr %%ax" : : "a"((uint16_t)GDT_CPU_TSS(cpu)));
+    __asm__ volatile("mov %%ax, %%gs" : : "a"((uint16_t)GDT_CPU_LOCAL(cpu)) : "memory");
+}
+
+// A task switch loads CR3 but never saves it, so both sides need it filled in
+void tss_set_cr3(uint32_t cr3) {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        cpu_tss[cpu].cr3 = cr3;
+        fault_tss[cpu].cr3 = cr3;
+    }
 }
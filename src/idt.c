@@ -4,13 +4,20 @@
 #include "task.h"
 #include "vesa.h"
 #include "kheap.h"
+#include "gdt.h"
+#include "image.h"
+#include "sched.h"
+#include "tickless.h"
+#include "apic.h"
+#include "smp.h"
 uint32_t timer_frequency = 0; // Global variable to store the frequency
-extern struct task task_list[];
-extern int current_task_idx;
 extern void isr0(); // Declaration of the assembly label
 volatile uint32_t system_ticks = 0;
 struct idt_entry idt[256];
 struct idt_ptr idtp;
+// APs get a copy that differs in one place: IDT 14 gates to their own fault task
+static struct idt_entry ap_idt[MAX_CPUS][256];
+static struct idt_ptr ap_idtp[MAX_CPUS];
 extern void isr128_stub();
 
 char *exception_messages[] = {
@@ -53,6 +60,31 @@ void isr_handler(struct registers *r) {
     while(1) __asm__("hlt");
 }
 
+/**
+ * Runs as its own hardware task (IDT 14 is a task gate), so it always has
+ * a good stack, even when a task ran off the end of its own. The faulting
+ * context sits in kernel_tss; returning lets it retry the instruction.
+ */
+void page_fault_handler(uint32_t error_code) {
+    uint32_t addr;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(addr));
+
+    // Stack growth (or a stack overflow the task module deals with)
+    if (task_stack_fault(addr)) return;
+    // First write to a shared program page
+    if (image_fault(addr, error_code)) return;
+
+    VESA_clear();
+    vesa_cursor_x = 0;
+    vesa_cursor_y = 0;
+    kprintf_color(COLOR_WHITE, "--- KERNEL PANIC ---\n");
+    kprintf_color(COLOR_WHITE, "Page Fault at 0x%x (%s, %s)\n", addr,
+        (error_code & 1) ? "protection" : "not present", (error_code & 2) ? "write" : "read");
+    kprintf_color(COLOR_WHITE, "EIP: %x  ESP: %x  Task: %d\n", kernel_tss.eip, kernel_tss.esp, current_task_idx);
+    VESA_flip();
+    while(1) __asm__("cli; hlt");
+}
+
 // In idt_init, map the first entry
 
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) {
@@ -104,20 +136,45 @@ void idt_init() {
     }
 
     idt_set_gate(128, (uint32_t)isr128_stub, 0x08, 0x8E);
+    extern void yield_stub();
+    idt_set_gate(YIELD_VECTOR, (uint32_t)yield_stub, 0x08, 0x8E);
     // ADD THIS: Handle the Timer (IRQ 0 -> INT 32)
     extern void irq0_handler();
     idt_set_gate(32, (uint32_t)irq0_handler, 0x08, 0x8E);
     idt_set_gate(0, (uint32_t)isr0, 0x08, 0x8E);
     extern void isr13();
     idt_set_gate(13, (uint32_t)isr13, 0x08, 0x8E); // Register GPF handler
+    idt_set_gate(14, 0, GDT_FAULT_TSS, 0x85);       // Page faults: task gate, see gdt.c
+    extern void nm_handler();
+    idt_set_gate(7, (uint32_t)nm_handler, 0x08, 0x8E); // Lazy FPU: first use after a switch
 
     // Keep your Keyboard (IRQ 1 -> INT 33)
     extern void irq1_handler();
     idt_set_gate(33, (uint32_t)irq1_handler, 0x08, 0x8E);
 
+    // Local APIC timer (APs) and the spurious vectors of both controllers
+    extern void lapic_timer_stub();
+    extern void spurious_stub();
+    idt_set_gate(APIC_TIMER_VECTOR, (uint32_t)lapic_timer_stub, 0x08, 0x8E);
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (uint32_t)spurious_stub, 0x08, 0x8E);
+    extern void tlb_shootdown_stub();
+    idt_set_gate(TLB_SHOOTDOWN_VECTOR, (uint32_t)tlb_shootdown_stub, 0x08, 0x8E);
+    extern void tickless_kick_stub();
+    idt_set_gate(TICKLESS_KICK_VECTOR, (uint32_t)tickless_kick_stub, 0x08, 0x8E);
+    idt_set_gate(39, (uint32_t)spurious_stub, 0x08, 0x8E); // 8259 IRQ 7
+    idt_set_gate(47, (uint32_t)spurious_stub, 0x08, 0x8E); // 8259 IRQ 15
+
     __asm__ volatile("lidt (%0)" : : "r" (&idtp));
 }
 
+void idt_load_cpu(int cpu) {
+    for (int i = 0; i < 256; i++) ap_idt[cpu][i] = idt[i];
+    ap_idt[cpu][14].sel = GDT_CPU_FAULT(cpu);
+    ap_idtp[cpu].limit = sizeof(ap_idt[cpu]) - 1;
+    ap_idtp[cpu].base = (uint32_t)&ap_idt[cpu];
+    __asm__ volatile("lidt (%0)" : : "r" (&ap_idtp[cpu]));
+}
+
 
 
 
@@ -126,17 +183,25 @@ void timer_init(uint32_t frequency) {
     if (frequency == 0) frequency = 1; // Prevent division by zero
     timer_frequency = frequency; 
 
-    uint32_t divisor = 1193182 / frequency;
-    outb(0x43, 0x36);
+    // Mode 2 (rate generator) rather than square wave: the count runs
+    // down linearly, so tickless idle can read the phase back
+    uint32_t divisor = PIT_HZ / frequency;
+    outb(0x43, 0x34);
     outb(0x40, (uint8_t)(divisor & 0xFF));
     outb(0x40, (uint8_t)((divisor >> 8) & 0xFF));
 }
 
-// Define this at the top of idt.c
-uint32_t next_stack_ptr = 0;
 extern uint32_t target_fps;
-void timer_handler(struct registers *regs) {
-    system_ticks++;
+static uint32_t last_flip_tick = 0;
+/**
+ * IRQ 0. Returns the stack of the task to switch to, or 0 to resume the
+ * one that was interrupted (irq0_handler does the switch).
+ */
+uint32_t timer_handler(struct registers *regs) {
+    uint32_t next = 0;
+    // One tick, unless we are coming out of a tickless stretch
+    uint32_t elapsed = tickless_sync();
+    system_ticks += elapsed;
     // Calculate how many ticks must pass for one frame
     // Example: 1000Hz / 60 FPS = 16 ticks
     uint32_t ticks_per_frame = timer_frequency / target_fps;
@@ -144,48 +209,29 @@ void timer_handler(struct registers *regs) {
     // Safety: Ensure we don't divide by zero or get a 0 interval
     if (ticks_per_frame == 0) ticks_per_frame = 1;
 
-    // Now it updates based on your variable!
-    if (system_ticks % ticks_per_frame == 0) {
+    // Ticks can jump after idle, so compare against the last flip
+    if (system_ticks - last_flip_tick >= ticks_per_frame) {
+        last_flip_tick = system_ticks;
         VESA_flip();
     }if (multitasking_enabled){
     // --- NEW: CPU Accounting ---
-    // Increment the tick count for the task that was just interrupted.
+    // Charge the ticks that went by to the task that was just interrupted.
     // This tracks how much actual CPU time each process is getting.
-    if (task_list[current_task_idx].state != 0) {
-        task_list[current_task_idx].total_ticks++;
-    }
-
-    // 1. Update sleeping tasks
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (task_list[i].state == 2) { // 2 = SLEEPING
-            if (task_list[i].sleep_ticks > 0) {
-                task_list[i].sleep_ticks--;
-            } 
-            // Check again after decrementing to wake up immediately if time is up
-            if (task_list[i].sleep_ticks == 0) {
-                task_list[i].state = 1; // Wake up! Set to READY
-            }
-        }
+    if (current_task->state != 0) {
+        current_task->total_ticks += elapsed;
     }
 
-    // 2. Save current task ESP
-    // This stores the stack pointer so we can resume this task later
-    task_list[current_task_idx].esp = (uint32_t)regs;
+    // 1. Expired timers (sleepers wake up through here)
+    timer_tick(system_ticks);
 
-    // 3. Find NEXT task that is READY (state 1)
-    int next_task = (current_task_idx + 1) % MAX_TASKS;
-    int check_count = 0;
-    while (task_list[next_task].state != 1 && check_count < MAX_TASKS) {
-        next_task = (next_task + 1) % MAX_TASKS;
-        check_count++;
-    }
-
-    // Update global pointers for the Assembly stub to perform the switch
-    current_task_idx = next_task;
-    next_stack_ptr = task_list[current_task_idx].esp;
+    // 2. Charge the quantum, then switch if it ran out or someone more important woke up
+    this_cpu()->ticks += elapsed;
+    sched_tick(elapsed);
+    next = schedule((uint32_t)regs);
   }
-    // Send End of Interrupt (EOI) to the PIC
-    outb(0x20, 0x20);
+    // Send End of Interrupt (EOI) to the PIC / local APIC
+    irq_eoi();
+    return next;
 }
 // Track shift state globally in idt.c or io.c
 
@@ -224,128 +270,7 @@ void keyboard_handler(struct registers *regs) {
         }
     }
 
-    outb(0x20, 0x20);
-}
-
-void syscall_handler(struct registers *regs) {
-    if (regs->eax == 1) { // DRAW_CHAR
-    char c = (char)regs->ebx;
-    int x = regs->ecx;
-    int y = regs->edx;
-    int id = current_task_idx;
-
-    // Expand bounds to include this new character
-    if (x < task_list[id].first_x) task_list[id].first_x = x;
-    if (y < task_list[id].first_y) task_list[id].first_y = y;
-    
-    // Check the right and bottom edges (8 pixels for a standard font)
-    if (x + 8 > task_list[id].last_x) task_list[id].last_x = x + 8;
-    if (y + 8 > task_list[id].last_y) task_list[id].last_y = y + 8;
-
-    task_list[id].has_drawn = 1;
-    VESA_draw_char(c, x, y, 0xFFFFFF); 
-}
-    else if (regs->eax == 2) { // Get Ticks
-        regs->eax = system_ticks; 
-    }
-
-else if (regs->eax == 3) { // Syscall 3: Sleep(ms)
-    uint32_t ms = regs->ebx;
-    
-    // 1. Convert Milliseconds to Ticks based on current frequency
-    // Formula: Ticks = (ms * frequency) / 1000
-    uint32_t ticks_to_sleep = (ms * timer_frequency) / 1000;
-
-    // Safety: Ensure we sleep at least 1 tick if ms > 0
-    if (ms > 0 && ticks_to_sleep == 0) {
-        ticks_to_sleep = 1;
-    }
-
-    task_list[current_task_idx].sleep_ticks = ticks_to_sleep; 
-    task_list[current_task_idx].state = 2; // Set state to SLEEPING
-    task_list[current_task_idx].esp = (uint32_t)regs;
-
-    // 2. Find the next READY task
-    int next_task = (current_task_idx + 1) % MAX_TASKS;
-    int found = -1;
-    for (int i = 0; i < MAX_TASKS; i++) {
-        int idx = (next_task + i) % MAX_TASKS;
-        if (task_list[idx].state == 1) { // Found a READY task
-            found = idx;
-            break;
-        }
-    }
-
-    // 3. SAFETY: If NO other task is ready (e.g., shell is alone and no idle task),
-    // we cannot put the current task to sleep or the CPU will have nothing to run.
-    if (found == -1 || found == current_task_idx) {
-        task_list[current_task_idx].state = 1; // Keep it READY
-        next_stack_ptr = 0;                    // Don't switch stacks
-        return; 
-    }
-
-    // 4. Perform the switch
-    current_task_idx = found;
-    next_stack_ptr = task_list[found].esp;
-  }
-  else if (regs->eax == 4) { // Syscall 4: Exit/Terminate
-    kprintf_unsync("Task %d exited.\n", current_task_idx);
-    task_list[current_task_idx].state = 0; // Set to DEAD
-    if (task_list[current_task_idx].has_drawn) {
-        int w = task_list[current_task_idx].last_x - task_list[current_task_idx].first_x;
-        int h = task_list[current_task_idx].last_y - task_list[current_task_idx].first_y;
-        
-        // Safety check to prevent massive unsigned underflow clears
-        if (w > 0 && w < 2000 && h > 0 && h < 2000) {
-            VESA_clear_region(task_list[current_task_idx].first_x, task_list[current_task_idx].first_y, w, h);
-            VESA_flip(); 
-        }
-    }
-    // --- CLEANUP STACK ---
-    if (task_list[current_task_idx].stack_ptr != NULL) {
-        kfree(task_list[current_task_idx].stack_ptr);
-        task_list[current_task_idx].stack_ptr = NULL;
-    }
-
-    // --- CLEANUP CODE (The missing 4KB!) ---
-    if (task_list[current_task_idx].code_ptr != NULL) {
-        kfree(task_list[current_task_idx].code_ptr);
-        task_list[current_task_idx].code_ptr = NULL; 
-    }
-    // Immediately switch to another task
-    int next_task = (current_task_idx + 1) % MAX_TASKS;
-    while(task_list[next_task].state != 1) next_task = (next_task + 1) % MAX_TASKS;
-    
-    current_task_idx = next_task;
-    next_stack_ptr = task_list[next_task].esp;
-  }
-else if (regs->eax == 5) { // Syscall 5: Clear Screen
-    VESA_clear();
-    // It's good practice to also reset the kernel's bounding box 
-    // because the screen is now empty.
-    task_list[current_task_idx].first_x = 0;
-    task_list[current_task_idx].first_y = 0;
-    task_list[current_task_idx].last_x = 0;
-    task_list[current_task_idx].last_y = 0;
-    task_list[current_task_idx].has_drawn = 0;
-}
-else if (regs->eax == 6) { // DRAW_RECT
-    int x = regs->ebx;
-    int y = regs->ecx;
-    int w = regs->edx;
-    int h = regs->esi;          // We'll use ESI for height
-    uint32_t color = regs->edi; // We'll use EDI for color
-
-    // Update the Task's bounding box for auto-cleanup
-    if (x < task_list[current_task_idx].first_x) task_list[current_task_idx].first_x = x;
-    if (y < task_list[current_task_idx].first_y) task_list[current_task_idx].first_y = y;
-    if (x + w > task_list[current_task_idx].last_x) task_list[current_task_idx].last_x = x + w;
-    if (y + h > task_list[current_task_idx].last_y) task_list[current_task_idx].last_y = y + h;
-
-    task_list[current_task_idx].has_drawn = 1;
-    
-    VESA_draw_rect(x, y, w, h, color);
-}
+    irq_eoi();
 }
 
 // Helper to emit a MOV instruction for a specific register
@@ -381,13 +306,11 @@ void assemble_line(const char* line, uint8_t* out_buf, uint32_t* pos) {
         emit_mov(0xB9, x, out_buf, pos);    // MOV ECX, x
         emit_mov(0xBA, y, out_buf, pos);    // MOV EDX, y
         
-        out_buf[(*pos)++] = 0xCD; // INT 0x80
-        out_buf[(*pos)++] = 0x80;
+        emit_syscall(out_buf, pos); // SYSENTER if we have it, else INT 0x80
     }
     else if (kstrcmp(cmd, "GET_TICKS") == 0) {
         emit_mov(0xB8, 2, out_buf, pos); // MOV EAX, 2
-        out_buf[(*pos)++] = 0xCD; 
-        out_buf[(*pos)++] = 0x80;
+        emit_syscall(out_buf, pos); // SYSENTER if we have it, else INT 0x80
     }
     else if (kstrcmp(cmd, "SLEEP") == 0) {
         uint32_t ms;
@@ -396,13 +319,11 @@ void assemble_line(const char* line, uint8_t* out_buf, uint32_t* pos) {
 
         emit_mov(0xB8, 3, out_buf, pos); // EAX=3
         emit_mov(0xBB, ms, out_buf, pos); // EBX=ms
-        out_buf[(*pos)++] = 0xCD; 
-        out_buf[(*pos)++] = 0x80;
+        emit_syscall(out_buf, pos); // SYSENTER if we have it, else INT 0x80
     }
     else if (kstrcmp(cmd, "EXIT") == 0) {
         emit_mov(0xB8, 4, out_buf, pos); // EAX=4
-        out_buf[(*pos)++] = 0xCD; 
-        out_buf[(*pos)++] = 0x80;
+        emit_syscall(out_buf, pos); // SYSENTER if we have it, else INT 0x80
     }
     else if (kstrcmp(cmd, "NOP") == 0) {
         out_buf[(*pos)++] = 0x90;
@@ -428,13 +349,11 @@ else if (kstrcmp(cmd, "RECT") == 0) {
     emit_mov(0xBE, h, out_buf, pos);     // ESI = h (Opcode 0xBE)
     emit_mov(0xBF, color, out_buf, pos); // EDI = color (Opcode 0xBF)
     
-    out_buf[(*pos)++] = 0xCD; // INT 0x80
-    out_buf[(*pos)++] = 0x80;
+    emit_syscall(out_buf, pos); // SYSENTER if we have it, else INT 0x80
 }
 else if (kstrcmp(cmd, "CLEAR") == 0) {
     // We only need to set EAX to 5 and trigger the interrupt
     emit_mov(0xB8, 5, out_buf, pos); // MOV EAX, 5
-    out_buf[(*pos)++] = 0xCD;        // INT 0x80
-    out_buf[(*pos)++] = 0x80;
+    emit_syscall(out_buf, pos); // SYSENTER if we have it, else INT 0x80
 }
 }
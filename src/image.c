@@ -0,0 +1,279 @@
+#include "image.h"
+#include "paging.h"
+#include "pmm.h"
+#include "kheap.h"
+#include "task.h"
+#include "spinlock.h"
+#include "lib.h"
+
+/*
+ * Loaded-image cache. A program is read from disk once into a set of
+ * frames; every RUN of the same file maps those frames read-only into a
+ * fresh instance window. The first write to a page faults and the
+ * instance gets a private copy of just that page (copy-on-write).
+ */
+
+static struct image* image_cache = NULL; // Most recently used first
+static struct image* instance_image[IMAGE_INSTANCES];
+static spinlock_t image_lock = SPINLOCK_INIT;
+// One user per scratch window at a time, whichever CPU it's on
+static spinlock_t scratch_load_lock = SPINLOCK_INIT;
+static spinlock_t scratch_cow_lock = SPINLOCK_INIT;
+static uint32_t image_loads = 0;
+static uint32_t image_hits = 0;
+
+static uint32_t instance_base(int k) {
+    return IMAGE_REGION + (uint32_t)k * IMAGE_SLOT;
+}
+
+// Plain movsl: the fault task must not touch kernel_fpu state
+static void copy_page(uint32_t dst, uint32_t src) {
+    uint32_t n = 1024;
+    __asm__ volatile("rep movsl" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static void image_free(struct image* img) {
+    for (uint32_t i = 0; i < img->pages; i++) {
+        if (img->frames[i]) pmm_free_page((void*)img->frames[i]);
+    }
+    kfree(img->frames);
+    kfree(img);
+}
+
+// Keeps at most IMAGE_CACHE_MAX unreferenced images, dropping the oldest
+static void image_evict() {
+    uint32_t idle = 0;
+    struct image** link = &image_cache;
+    while (*link) {
+        struct image* img = *link;
+        if (img->refs == 0 && ++idle > IMAGE_CACHE_MAX) {
+            *link = img->next;
+            image_free(img);
+            continue;
+        }
+        link = &img->next;
+    }
+}
+
+// Cache lookup by file identity; takes a reference and moves the hit to the front
+static struct image* image_lookup(struct fat_dir_entry* entry) {
+    struct image** link = &image_cache;
+    while (*link) {
+        struct image* img = *link;
+        if (img->cluster == entry->first_cluster_low && img->size == entry->size &&
+            img->write_time == entry->last_write_time && img->write_date == entry->last_write_date) {
+            *link = img->next;
+            img->next = image_cache;
+            image_cache = img;
+            img->refs++;
+            return img;
+        }
+        link = &img->next;
+    }
+    return NULL;
+}
+
+/**
+ * Reads the file into freshly allocated frames, zero-padding the last
+ * page. The image comes back with one reference and is not yet cached.
+ */
+static struct image* image_load(struct fat_dir_entry* entry) {
+    if (entry->size == 0 || entry->size > IMAGE_SLOT) return NULL;
+
+    uint8_t* data = (uint8_t*)fat_load_file(entry);
+    if (!data) return NULL;
+
+    uint32_t pages = (entry->size + 0xFFF) / 4096;
+    struct image* img = (struct image*)kmalloc(sizeof(struct image));
+    uint32_t* frames = (uint32_t*)kmalloc(pages * sizeof(uint32_t));
+    if (!img || !frames) {
+        if (img) kfree(img);
+        if (frames) kfree(frames);
+        kfree(data);
+        return NULL;
+    }
+
+    img->cluster = entry->first_cluster_low;
+    img->write_time = entry->last_write_time;
+    img->write_date = entry->last_write_date;
+    img->size = entry->size;
+    img->pages = 0;
+    img->frames = frames;
+    img->refs = 1;
+    img->cow_pages = 0;
+    img->stale = 0;
+    img->next = NULL;
+
+    // Fill each frame through the scratch window
+    for (uint32_t i = 0; i < pages; i++) {
+        void* frame = pmm_alloc_page();
+        uint32_t flags = spin_lock_irqsave(&scratch_load_lock);
+        if (!frame || map_page(IMAGE_SCRATCH_LOAD, (uint32_t)frame) != 0) {
+            spin_unlock_irqrestore(&scratch_load_lock, flags);
+            if (frame) pmm_free_page(frame);
+            image_free(img);
+            kfree(data);
+            return NULL;
+        }
+        frames[i] = (uint32_t)frame;
+        img->pages = i + 1;
+
+        uint32_t offset = i * 4096;
+        uint32_t chunk = (img->size - offset > 4096) ? 4096 : img->size - offset;
+        kmemset((void*)IMAGE_SCRATCH_LOAD, 0, 1024);
+        kmemcpy((void*)IMAGE_SCRATCH_LOAD, data + offset, chunk);
+        unmap_page(IMAGE_SCRATCH_LOAD);
+        spin_unlock_irqrestore(&scratch_load_lock, flags);
+    }
+
+    kfree(data);
+    return img;
+}
+
+/**
+ * Starts a task running the program in 'entry'. Only the first instance
+ * of a file reads the disk; the rest just map the cached frames.
+ * Returns the TID or -1.
+ */
+int image_spawn(struct fat_dir_entry* entry, char* name) {
+    // 1. Cached image or a fresh load
+    uint32_t flags = spin_lock_irqsave(&image_lock);
+    struct image* img = image_lookup(entry);
+    if (img) image_hits++;
+    spin_unlock_irqrestore(&image_lock, flags);
+
+    if (!img) {
+        img = image_load(entry); // Disk I/O, so not under the lock
+        if (!img) return -1;
+        flags = spin_lock_irqsave(&image_lock);
+        img->next = image_cache;
+        image_cache = img;
+        image_loads++;
+        spin_unlock_irqrestore(&image_lock, flags);
+    }
+
+    // 2. Claim an instance window
+    int k = -1;
+    flags = spin_lock_irqsave(&image_lock);
+    for (int i = 0; i < IMAGE_INSTANCES; i++) {
+        if (!instance_image[i]) {
+            instance_image[i] = img;
+            k = i;
+            break;
+        }
+    }
+    if (k < 0) {
+        img->refs--;
+        image_evict();
+        spin_unlock_irqrestore(&image_lock, flags);
+        return -1;
+    }
+    spin_unlock_irqrestore(&image_lock, flags);
+
+    // 3. Map the shared frames read-only; writes fault into image_fault
+    uint32_t base = instance_base(k);
+    for (uint32_t i = 0; i < img->pages; i++) {
+        if (paging_map(base + i * 4096, img->frames[i], 0) != 0) {
+            image_unmap(base);
+            return -1;
+        }
+    }
+
+    int tid = spawn_task((void (*)())base, (void*)base, name);
+    if (tid < 0) image_unmap(base);
+    return tid;
+}
+
+/**
+ * Tears down an instance window: private copies go back to the PMM, shared
+ * frames stay with the image. Safe to call from the exit syscall.
+ */
+void image_unmap(uint32_t base) {
+    if (base < IMAGE_REGION || base >= IMAGE_REGION_END) return;
+    int k = (base - IMAGE_REGION) / IMAGE_SLOT;
+    struct image* img = instance_image[k];
+    if (!img) return;
+
+    for (uint32_t i = 0; i < img->pages; i++) {
+        uint32_t page = instance_base(k) + i * 4096;
+        uint32_t phys = paging_get_phys(page) & ~0xFFF;
+        if (!phys) continue;
+        unmap_page(page);
+        if (phys != img->frames[i]) pmm_free_page((void*)phys);
+    }
+
+    uint32_t flags = spin_lock_irqsave(&image_lock);
+    instance_image[k] = NULL;
+    img->refs--;
+    if (img->refs == 0) {
+        if (img->stale) image_free(img); // Already out of the cache list
+        else image_evict();
+    }
+    spin_unlock_irqrestore(&image_lock, flags);
+}
+
+/**
+ * Copy-on-write, called from the page-fault task. Returns 1 if the write
+ * hit a shared image page and the instance now has its own copy.
+ */
+int image_fault(uint32_t addr, uint32_t error_code) {
+    if (addr < IMAGE_REGION || addr >= IMAGE_REGION_END) return 0;
+    if ((error_code & 3) != 3) return 0; // Only writes to present pages
+
+    int k = (addr - IMAGE_REGION) / IMAGE_SLOT;
+    struct image* img = instance_image[k];
+    if (!img) return 0;
+
+    uint32_t page = addr & ~0xFFF;
+    uint32_t idx = (page - instance_base(k)) / 4096;
+    if (idx >= img->pages) return 0;
+
+    uint32_t entry = paging_get_entry(page);
+    if ((entry & PAGE_WRITE) || (entry & ~0xFFF) != img->frames[idx]) return 0;
+
+    void* frame = pmm_alloc_page();
+    if (!frame) return 0;
+    spin_lock(&scratch_cow_lock); // Fault task: interrupts are already off
+    if (map_page(IMAGE_SCRATCH_COW, (uint32_t)frame) != 0) {
+        spin_unlock(&scratch_cow_lock);
+        pmm_free_page(frame);
+        return 0;
+    }
+    copy_page(IMAGE_SCRATCH_COW, page);
+    unmap_page(IMAGE_SCRATCH_COW);
+    spin_unlock(&scratch_cow_lock);
+
+    paging_map(page, (uint32_t)frame, PAGE_WRITE);
+    img->cow_pages++;
+    return 1;
+}
+
+/**
+ * The file starting at 'cluster' was rewritten or removed. FAT writes here
+ * don't bump the mtime, so the cache has to be told.
+ */
+void image_invalidate(uint16_t cluster) {
+    if (cluster < 2) return;
+    uint32_t flags = spin_lock_irqsave(&image_lock);
+    struct image** link = &image_cache;
+    while (*link) {
+        struct image* img = *link;
+        if (img->cluster == cluster) {
+            *link = img->next;
+            if (img->refs == 0) image_free(img);
+            else img->stale = 1; // Running instances keep their frames
+            continue;
+        }
+        link = &img->next;
+    }
+    spin_unlock_irqrestore(&image_lock, flags);
+}
+
+void image_print_stats() {
+    kprintf_unsync("Images: %d loads, %d cache hits\n", image_loads, image_hits);
+    kprintf_unsync("CLUSTER  SIZE     PAGES  INSTANCES  COW\n");
+    for (struct image* img = image_cache; img; img = img->next) {
+        kprintf_unsync("%d       %d      %d      %d          %d\n",
+            img->cluster, img->size, img->pages, img->refs, img->cow_pages);
+    }
+}
@@ -3,7 +3,12 @@ extern timer_handler
 extern keyboard_handler
 extern syscall_handler
 extern isr_handler
-extern next_stack_ptr    ; Defined in idt.c or task.c
+extern page_fault_handler
+extern apic_timer_handler
+extern schedule
+extern fpu_trap
+extern syscall_dispatch
+extern schedule_tail     ; sched.c: the task we switched away from is off this CPU
 
 ; --- Macros for Processor Exceptions ---
 %macro ISR_NOERRCODE 1
@@ -61,11 +66,10 @@ isr_common_stub:
     mov ax, ds
     push eax            
 
-    mov ax, 0x10        
+    mov ax, 0x10        ; GS stays: it points at this CPU's cpu_local
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
     push esp            
     call isr_handler
@@ -75,11 +79,33 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     popa
     add esp, 8          
     iret
 
+; --- Page Fault Task ---
+; IDT 14 is a task gate (see gdt.c), so we arrive here on our own stack
+; with the faulting context saved in kernel_tss.
+
+global page_fault_task
+page_fault_task:
+    call page_fault_handler ; The CPU pushed the error code, it is our argument
+    add esp, 4
+    iret                    ; NT is set: switches back to the faulting task
+    jmp page_fault_task     ; The next fault resumes right here
+
+; --- Device Not Available (#NM) ---
+; First FPU/SSE use since a switch (or since a hardware task switch set
+; CR0.TS): fpu_trap loads the task's state. No error code, and only
+; kernel segments are ever live here.
+
+global nm_handler
+nm_handler:
+    pusha
+    call fpu_trap
+    popa
+    iret
+
 ; --- Hardware IRQ Handlers ---
 
 global irq0_handler
@@ -95,15 +121,14 @@ irq0_handler:
     mov es, ax
 
     push esp            
-    call timer_handler
+    call timer_handler  ; Returns the next task's stack, 0 = stay
     add esp, 4          
 
     ; --- TASK SWITCH LOGIC (Timer) ---
-    mov eax, [next_stack_ptr]
     test eax, eax       
     jz .no_switch
     mov esp, eax        
-    mov dword [next_stack_ptr], 0 ; Clear the pointer after switch
+    call schedule_tail
 .no_switch:
 
     pop eax             
@@ -152,21 +177,8 @@ isr128_stub:
     mov es, ax
 
     push esp            
-    call syscall_handler
-    
-    ; Save return value from EAX into the stack frame for popa
-    mov [esp + 32], eax 
-
+    call syscall_handler ; Results go back through regs->eax/edx; sleep and exit switch via yield()
     add esp, 4          
-    
-    ; --- TASK SWITCH LOGIC (Syscall/Sleep) ---
-    ; This fixes the GPF 13 by swapping stacks here instead of inside C
-    mov eax, [next_stack_ptr]
-    test eax, eax
-    jz .no_switch_syscall
-    mov esp, eax        ; Load the stack of the NEXT task
-    mov dword [next_stack_ptr], 0 ; Clear pointer
-.no_switch_syscall:
 
     pop eax             
     mov ds, ax
@@ -176,6 +188,124 @@ isr128_stub:
     add esp, 8          
     iret
 
+; --- Fast system calls (SYSENTER) ---
+; Callers do 'call 1f / jmp 2f / 1: push ebp / mov ebp, esp / sysenter / 2:'
+; (syscall.h). SYSENTER lands here on this CPU's MSR stack with IF clear;
+; EBP takes us straight back to the caller's stack, where its saved EBP
+; and the return address of that call are waiting. Only EAX/EDX change.
+
+global sysenter_entry
+sysenter_entry:
+    mov esp, ebp
+    push edi            ; struct syscall_args, eax at the lowest address
+    push esi
+    push edx
+    push ecx
+    push ebx
+    push eax
+
+    push esp
+    call syscall_dispatch
+    add esp, 4
+
+    pop eax
+    pop ebx
+    pop ecx
+    pop edx
+    pop esi
+    pop edi
+    pop ebp
+    sti                 ; Callers always run with interrupts on
+    ret
+
+; --- Voluntary switch (int 0x81, yield) ---
+; Only ever raised by kernel code, so DS/ES are already the kernel's and
+; there's no PIC/APIC to acknowledge. The frame is the same as irq0's so
+; any stub can resume the task later; schedule() gets it directly.
+
+global yield_stub
+yield_stub:
+    push byte 0
+    push dword 0x81
+    pusha
+    mov ax, ds
+    push eax
+
+    push esp
+    call schedule       ; Returns the next task's stack, 0 = stay
+    add esp, 4
+
+    test eax, eax
+    jz .no_switch_yield
+    mov esp, eax
+    call schedule_tail
+.no_switch_yield:
+
+    pop eax
+    mov ds, ax
+    mov es, ax
+    popa
+    add esp, 8
+    iret
+
+; --- Local APIC timer (APs) ---
+; Same frame as irq0_handler, so a task preempted here can be resumed
+; from either.
+
+global lapic_timer_stub
+lapic_timer_stub:
+    push byte 0
+    push byte 48
+    pusha
+    mov ax, ds
+    push eax
+
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+
+    push esp
+    call apic_timer_handler
+    add esp, 4
+
+    test eax, eax
+    jz .no_switch_lapic
+    mov esp, eax
+    call schedule_tail
+.no_switch_lapic:
+
+    pop eax
+    mov ds, ax
+    mov es, ax
+    popa
+    add esp, 8
+    iret
+
+; --- TLB shootdown IPI ---
+; Interrupts only kernel code, nothing to switch to afterwards.
+
+global tlb_shootdown_stub
+tlb_shootdown_stub:
+    pusha
+    call tlb_shootdown_handler
+    popa
+    iret
+
+; --- Tickless kick IPI (boot CPU) ---
+; Same deal: the next tick IRQ does the rescheduling.
+
+global tickless_kick_stub
+tickless_kick_stub:
+    pusha
+    call tickless_kick_handler
+    popa
+    iret
+
+; Spurious interrupts (LAPIC 0xFF, 8259 IRQ 7/15) get no EOI
+global spurious_stub
+spurious_stub:
+    iret
+
 ; --- Utility Functions ---
 
 global idt_flush
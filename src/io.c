@@ -1,11 +1,15 @@
 #include "io.h"
 #include "task.h"
+#include "sched.h"
+#include "wait.h"
+#include "idt.h"
 // A simple circular buffer for the keyboard
 static char key_buffer[256];
 static int head = 0;
 static int tail = 0;
 extern int keyboard_focus_tid;
-extern int current_task_idx;
+// Readers blocked in keyboard_wait; a key only wakes the one with focus
+static struct wait_queue key_wait = WAIT_QUEUE_INIT;
 // This is what the Linker is looking for!
 int has_key_in_buffer() {
     return head != tail;
@@ -25,6 +29,13 @@ void keyboard_push_char(char c) {
         key_buffer[head] = c;
         head = next;
     }
+    wake_up_tid(&key_wait, keyboard_focus_tid);
+}
+
+// Hands the keyboard to 'tid'; everyone waiting re-checks whether it's them
+void keyboard_set_focus(int tid) {
+    keyboard_focus_tid = tid;
+    wake_up(&key_wait);
 }
 
 uint8_t keyboard_read_status() {
@@ -36,26 +47,48 @@ uint8_t keyboard_read_scancode() {
 }
 
 
-char keyboard_getchar() {
+/**
+ * Blocks until the calling task has focus and a key is waiting, or for
+ * at most 'ticks' (0 = forever). Returns the key, or 0 on timeout.
+ */
+static char keyboard_wait(uint32_t ticks) {
+    struct task* cur = current_task;
+    int waited = 0;
     while (1) {
-        // 1. If this task does NOT have focus, it must not touch the buffer!
-        // It just yields and waits for its turn to be the foreground task.
-        if (current_task_idx != keyboard_focus_tid) {
-            yield();
-            continue; 
-        }
-
-        // 2. If we HAVE focus, check if there is a key waiting
-       if (has_key_in_buffer()) {
-        asm volatile("cli"); // Disable interrupts
-        char c = get_key_from_buffer();
-        asm volatile("sti"); // Enable interrupts
-        return c;
-      }
-
-        // 3. No key? Yield to let other tasks (like the Spinner) run
+        // 1. Queue up (and arm the timeout) before looking, so a key arriving
+        // in between still wakes us, even if we get preempted right here
+        uint32_t flags = irq_save();
+        wait_prepare(&key_wait);
+        if (ticks && !waited) sched_sleep(ticks);
+        irq_restore(flags);
+        if (cur->tid == keyboard_focus_tid && has_key_in_buffer()) break;
+
+        // 2. The timeout already went off
+        if (ticks && waited && !cur->sleep_timer.pending) break;
+
+        // 3. Off the CPU until the keyboard IRQ, a focus change or the timeout
+        waited = 1;
         yield();
     }
+    wait_finish(&key_wait);
+    if (ticks) timer_cancel(&cur->sleep_timer);
+
+    char c = 0;
+    uint32_t flags = irq_save();
+    if (cur->tid == keyboard_focus_tid) c = get_key_from_buffer();
+    irq_restore(flags);
+    // Waited on the user: back to full priority, like any I/O-bound task
+    if (c && waited) sched_boost(cur->tid);
+    return c;
+}
+
+char keyboard_getchar() {
+    return keyboard_wait(0);
+}
+
+// Like keyboard_getchar, but gives up after 'ms' and returns 0
+char keyboard_getchar_timeout(uint32_t ms) {
+    return keyboard_wait(sched_ms_to_ticks(ms));
 }
 
 char scancode_to_ascii(uint8_t scancode, int shift) {
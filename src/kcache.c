@@ -0,0 +1,234 @@
+#include "kcache.h"
+#include "kheap.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "task.h"
+#include "lib.h"
+
+/*
+ * Magazine layer (Bonwick & Adams) in front of the kernel heap.
+ *
+ * Each CPU owns a 'loaded' and a 'previous' magazine per size class and
+ * serves kmalloc/kfree out of them with nothing but interrupts off, so the
+ * common path never touches shared state. Only when both are empty (or
+ * both full) does it swap a whole magazine with the depot, which is the
+ * one place with a lock. The depot in turn refills from and drains to the
+ * heap a full magazine at a time.
+ *
+ * Until the APs run there is a single CPU slot, and masking interrupts is
+ * what keeps a task switch from landing in the middle of a magazine op.
+ */
+
+struct kcache_cpu {
+    struct magazine* loaded[KCACHE_CLASSES];
+    struct magazine* previous[KCACHE_CLASSES];
+    uint32_t hits[KCACHE_CLASSES]; // Served without leaving this CPU
+};
+
+struct kcache_depot {
+    spinlock_t lock;
+    struct magazine* full;  // Stack of full magazines
+    struct magazine* empty; // Stack of empty ones, ready for frees
+    uint32_t full_count;
+    // Stats
+    uint32_t exchanges; // Magazine swapped with the depot
+    uint32_t refills;   // Magazine filled from the heap
+    uint32_t drains;    // Magazine emptied back to the heap
+};
+
+static struct kcache_cpu kcache_cpus[MAX_CPUS];
+static struct kcache_depot depots[KCACHE_CLASSES];
+
+static int size_to_class(uint32_t size) {
+    int c = 0;
+    while ((1u << (KCACHE_MIN_SHIFT + c)) < size) c++;
+    return c;
+}
+
+static struct magazine* magazine_new() {
+    struct magazine* m = (struct magazine*)kheap_alloc(sizeof(struct magazine),
+        (uint32_t)__builtin_return_address(0));
+    if (m) {
+        m->next = NULL;
+        m->rounds = 0;
+    }
+    return m;
+}
+
+static void tag_owner(void* obj, uint32_t caller) {
+#if KHEAP_TRACE
+    header_t* h = KHEAP_HEADER(obj);
+    h->caller = caller;
+    h->tid = caller ? (uint32_t)get_current_task_id() : 0;
+#else
+    (void)obj;
+    (void)caller;
+#endif
+}
+
+/**
+ * Slow half of kcache_alloc: both CPU magazines are empty. Trade the
+ * previous one for a full magazine from the depot, or fill it from the
+ * heap. Returns 0 if there is nothing left anywhere.
+ */
+static int kcache_reload(struct kcache_cpu* cc, int c) {
+    struct kcache_depot* d = &depots[c];
+    struct magazine* spare = cc->previous[c];
+
+    spin_lock(&d->lock);
+    if (d->full) {
+        struct magazine* m = d->full;
+        d->full = m->next;
+        d->full_count--;
+        spare->next = d->empty;
+        d->empty = spare;
+        d->exchanges++;
+        spin_unlock(&d->lock);
+
+        cc->previous[c] = cc->loaded[c];
+        cc->loaded[c] = m;
+        return 1;
+    }
+    d->refills++;
+    spin_unlock(&d->lock);
+
+    // Depot is dry: one batch from the heap fills the loaded magazine
+    struct magazine* m = cc->loaded[c];
+    m->rounds = kheap_alloc_batch(1u << (KCACHE_MIN_SHIFT + c), m->objs,
+        KCACHE_MAG_ROUNDS, KCACHE_TAG | c);
+    return m->rounds != 0;
+}
+
+/**
+ * Slow half of kcache_free: both CPU magazines are full. Push the previous
+ * one to the depot (or drain it to the heap if the depot has enough) and
+ * start over with an empty magazine.
+ */
+static int kcache_unload(struct kcache_cpu* cc, int c) {
+    struct kcache_depot* d = &depots[c];
+    struct magazine* full = cc->previous[c];
+
+    spin_lock(&d->lock);
+    if (d->full_count >= KCACHE_DEPOT_MAX) {
+        d->drains++;
+        spin_unlock(&d->lock);
+
+        // Enough cached already, give this batch back to the heap
+        kheap_free_batch(full->objs, full->rounds);
+        full->rounds = 0;
+        cc->previous[c] = cc->loaded[c];
+        cc->loaded[c] = full;
+        return 1;
+    }
+
+    struct magazine* empty = d->empty;
+    if (empty) d->empty = empty->next;
+    d->exchanges++;
+    spin_unlock(&d->lock);
+
+    if (!empty) empty = magazine_new();
+    if (!empty) return 0;
+
+    spin_lock(&d->lock);
+    full->next = d->full;
+    d->full = full;
+    d->full_count++;
+    spin_unlock(&d->lock);
+
+    cc->previous[c] = cc->loaded[c];
+    cc->loaded[c] = empty;
+    return 1;
+}
+
+// CPU magazines are created the first time a class is used
+static int kcache_ready(struct kcache_cpu* cc, int c) {
+    if (!cc->loaded[c]) cc->loaded[c] = magazine_new();
+    if (!cc->previous[c]) cc->previous[c] = magazine_new();
+    return cc->loaded[c] && cc->previous[c];
+}
+
+/**
+ * Allocates a small object from this CPU's magazines. Returns NULL only
+ * if the magazines could not be set up or the heap is exhausted; kmalloc
+ * then falls back to the plain heap.
+ */
+void* kcache_alloc(uint32_t size, uint32_t caller) {
+    int c = size_to_class(size);
+    void* obj = NULL;
+
+    uint32_t flags = irq_save();
+    struct kcache_cpu* cc = &kcache_cpus[cpu_id()];
+    if (!kcache_ready(cc, c)) goto out;
+
+    // 1. Loaded magazine, 2. previous magazine, 3. depot or heap
+    if (cc->loaded[c]->rounds == 0) {
+        if (cc->previous[c]->rounds > 0) {
+            struct magazine* t = cc->loaded[c];
+            cc->loaded[c] = cc->previous[c];
+            cc->previous[c] = t;
+        } else if (!kcache_reload(cc, c)) {
+            goto out;
+        }
+    } else {
+        cc->hits[c]++;
+    }
+
+    struct magazine* m = cc->loaded[c];
+    obj = m->objs[--m->rounds];
+    tag_owner(obj, caller);
+out:
+    irq_restore(flags);
+    return obj;
+}
+
+/**
+ * Takes the object back if it belongs to the magazine layer. Returns 0
+ * for anything else so kfree hands it to the heap.
+ */
+int kcache_free(void* ptr) {
+    uint32_t tag = kheap_block_tag(ptr);
+    if (!tag) return 0;
+    int c = tag & KCACHE_CLASS_MASK;
+    if (c >= KCACHE_CLASSES) return 0;
+
+    uint32_t flags = irq_save();
+    struct kcache_cpu* cc = &kcache_cpus[cpu_id()];
+    if (!kcache_ready(cc, c)) goto fallback;
+
+    if (cc->loaded[c]->rounds == KCACHE_MAG_ROUNDS) {
+        if (cc->previous[c]->rounds < KCACHE_MAG_ROUNDS) {
+            struct magazine* t = cc->loaded[c];
+            cc->loaded[c] = cc->previous[c];
+            cc->previous[c] = t;
+        } else if (!kcache_unload(cc, c)) {
+            goto fallback;
+        }
+    }
+
+    struct magazine* m = cc->loaded[c];
+    tag_owner(ptr, 0);
+    m->objs[m->rounds++] = ptr;
+    irq_restore(flags);
+    return 1;
+
+fallback:
+    // No magazine to put it in; the heap is happy to take it directly
+    irq_restore(flags);
+    kheap_free(ptr);
+    return 1;
+}
+
+void kcache_print_stats() {
+    kprintf_unsync("Magazines:  SIZE  CPU  DEPOT  HITS  SWAPS  REFILLS  DRAINS\n");
+    for (int c = 0; c < KCACHE_CLASSES; c++) {
+        struct kcache_depot* d = &depots[c];
+        uint32_t cpu_rounds = 0, hits = 0;
+        for (int i = 0; i < MAX_CPUS; i++) {
+            hits += kcache_cpus[i].hits[c];
+            if (kcache_cpus[i].loaded[c]) cpu_rounds += kcache_cpus[i].loaded[c]->rounds;
+            if (kcache_cpus[i].previous[c]) cpu_rounds += kcache_cpus[i].previous[c]->rounds;
+        }
+        kprintf_unsync("            %d  %d  %d  %d  %d  %d  %d\n", 1 << (KCACHE_MIN_SHIFT + c),
+            cpu_rounds, d->full_count * KCACHE_MAG_ROUNDS, hits, d->exchanges, d->refills, d->drains);
+    }
+}
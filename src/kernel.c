@@ -9,9 +9,13 @@
 #include "kheap.h"
 #include "vesa.h"
 #include "fat.h"
+#include "cpu.h"
+#include "simd.h"
+#include "smp.h"
+#include "clock.h"
+#include "syscall.h"
 
 // External references for memory and info
-extern char end;
 extern int system_ticks;
 
 void kmain(uint32_t magic, struct multiboot_info* mbi) {
@@ -19,14 +23,18 @@ void kmain(uint32_t magic, struct multiboot_info* mbi) {
     if (!(mbi->flags & (1 << 12))) return; 
 
     // 1. Core CPU structures
+    cpu_init();       // CPUID first, paging wants to know about PSE
+    simd_init();      // SSE2 copies for the framebuffer, if the CPU has them
     gdt_init(); 
     idt_init();       
+    syscall_init_cpu(0); // SYSENTER MSRs, if the CPU has them
     pic_remap();      // Remap PIC before any hardware init
+    clock_init();     // TSC against PIT channel 2, no IRQs needed
 
     // 2. Memory Management (Critical Order)
-    uint32_t ram_kb = mbi->mem_upper + 1024;
-    pmm_init(ram_kb * 1024, (uint32_t)&end); // PMM first
+    pmm_init(mbi);                           // PMM first (reads the memory map)
     paging_init(mbi);                        // Paging second
+    tss_set_cr3(read_cr3());                 // Page-fault task shares our directory
     init_kheap();                            // Heap third
 
     // 3. Hardware / Graphics
@@ -39,6 +47,7 @@ void kmain(uint32_t magic, struct multiboot_info* mbi) {
 
     // 5. Final output and interrupts
     __asm__ volatile("sti");
+    smp_init();       // Needs the timer running to pace INIT/SIPI
     VESA_print("KDXOS Kernel Ready.\n", 0x00FF00);
     
     shell_task();
@@ -1,26 +1,104 @@
 #include "kheap.h"
 #include "lib.h"
+#include "pmm.h"
+#include "paging.h"
+#include "simd.h"
+#include "task.h"
+#include "kcache.h"
+#include "spinlock.h"
 
 // The Linker provides this symbol
 extern uint32_t end; 
 uint32_t placement_address = (uint32_t)&end;
 
 header_t* heap_start = NULL;
+uint32_t heap_end = 0;        // One past the last mapped heap byte
+uint32_t heap_high_water = 0; // Largest heap_end we ever reached
+
+// Guards the block list. Magazines keep most small requests away from it.
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+/**
+ * Maps enough fresh PMM frames at heap_end to add 'bytes' of space
+ * and hands it to the last block. Returns 1 on success, 0 if the PMM
+ * or the heap window ran dry.
+ */
+static int kheap_grow(uint32_t bytes) {
+    uint32_t old_end = heap_end;
+    uint32_t new_end = (heap_end + bytes + 0xFFF) & ~0xFFF;
+    if (new_end > KHEAP_MAX || new_end < heap_end) return 0;
+
+    // 1. Back the new range page by page
+    while (heap_end < new_end) {
+        // Never paint over something else's mapping (e.g. a framebuffer)
+        if (paging_get_entry(heap_end) & PAGE_PRESENT) break;
+        void* frame = pmm_alloc_page();
+        if (!frame) break;
+        if (map_page(heap_end, (uint32_t)frame) != 0) {
+            pmm_free_page(frame);
+            break;
+        }
+        heap_end += 4096;
+    }
+    if (heap_end == old_end) return 0;
+    if (heap_end > heap_high_water) heap_high_water = heap_end;
+
+    // 2. Give the new space to the tail block (or start a new one)
+    uint32_t added = heap_end - old_end;
+    header_t* tail = heap_start;
+    while (tail->next) tail = tail->next;
+
+    if (tail->is_free) {
+        tail->size += added;
+    } else {
+        header_t* fresh = (header_t*)old_end;
+        fresh->size = added - sizeof(header_t);
+        fresh->is_free = 1;
+        fresh->next = NULL;
+        tail->next = fresh;
+    }
+    return heap_end == new_end;
+}
 
+/**
+ * Gives whole free pages at the end of the heap back to the PMM.
+ * 'tail' must be the last block and free. We keep KHEAP_MIN_SIZE
+ * mapped and only bother once KHEAP_TRIM_SLACK bytes are idle.
+ */
+static void kheap_trim(header_t* tail) {
+    uint32_t data_start = (uint32_t)tail + sizeof(header_t);
+    uint32_t keep_end = (data_start + 16 + 0xFFF) & ~0xFFF;
+    if (keep_end < KHEAP_START + KHEAP_MIN_SIZE) keep_end = KHEAP_START + KHEAP_MIN_SIZE;
+    if (keep_end >= heap_end || heap_end - keep_end < KHEAP_TRIM_SLACK) return;
+
+    while (heap_end > keep_end) {
+        heap_end -= 4096;
+        uint32_t phys = paging_get_phys(heap_end);
+        unmap_page(heap_end);
+        if (phys) pmm_free_page((void*)(phys & ~0xFFF));
+    }
+    tail->size = heap_end - data_start;
+}
 
 void init_kheap() {
-    uint32_t start_node = 0x800000;
-    // Total heap area: 16MB. 
-    // The data size of the first block is 16MB minus its own header.
-    uint32_t total_heap_size = 16 * 1024 * 1024; 
+    // Start small in the heap window; kmalloc grows it on demand.
+    heap_end = KHEAP_START;
+    heap_high_water = KHEAP_START;
+    for (uint32_t addr = KHEAP_START; addr < KHEAP_START + KHEAP_MIN_SIZE; addr += 4096) {
+        void* frame = pmm_alloc_page();
+        if (!frame || map_page(addr, (uint32_t)frame) != 0) break;
+        heap_end += 4096;
+    }
+    if (heap_end == KHEAP_START) return;
+    heap_high_water = heap_end;
 
-    heap_start = (header_t*)start_node;
-    heap_start->size = total_heap_size - sizeof(header_t); 
+    // One free block covering everything we mapped
+    heap_start = (header_t*)KHEAP_START;
+    heap_start->size = (heap_end - KHEAP_START) - sizeof(header_t); 
     heap_start->is_free = 1;
     heap_start->next = NULL;
 }
-void kfree(void* ptr) {
-    if (!ptr) return;
+static void kheap_free_locked(void* ptr) {
 
     header_t* curr = heap_start;
     header_t* prev = NULL;
@@ -58,28 +136,76 @@ void kfree(void* ptr) {
     if (prev_save && prev_save->is_free) {
         prev_save->size += sizeof(header_t) + target->size;
         prev_save->next = target->next;
+        target = prev_save;
+    }
+
+    // 5. TRIM: If we just freed the tail, hand idle pages back to the PMM
+    if (target->next == NULL) {
+        kheap_trim(target);
     }
 }
 
+void kheap_free(void* ptr) {
+    if (!ptr) return;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    kheap_free_locked(ptr);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+// Hands a whole drained magazine back under a single lock round trip
+void kheap_free_batch(void** objs, uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        if (objs[i]) kheap_free_locked(objs[i]);
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+    if (kcache_free(ptr)) return; // Small object, goes back into a magazine
+    kheap_free(ptr);
+}
+
+/**
+ * Returns the cache tag of the block starting at ptr, 0 if ptr is a plain
+ * heap block (or not the start of a block at all).
+ */
+uint32_t kheap_block_tag(void* ptr) {
+    uint32_t addr = (uint32_t)ptr;
+    if (addr < KHEAP_START + sizeof(header_t) || addr >= heap_end || (addr & 3)) return 0;
+    header_t* h = KHEAP_HEADER(ptr);
+    if (h->is_free || (h->cache_tag & ~KCACHE_CLASS_MASK) != KCACHE_TAG) return 0;
+    return h->cache_tag;
+}
+
 
 
 void* kmemcpy(void* dest, const void* src, uint32_t n) {
+    if (simd_available && n >= SIMD_MIN_BYTES) return simd_memcpy(dest, src, n);
+
+    // Dwords first, then the 0-3 byte tail
+    void* d = dest;
+    uint32_t dwords = n / 4;
+    uint32_t tail = n % 4;
     __asm__ volatile (
-        "movl %0, %%edi\n"
-        "movl %1, %%esi\n"
-        "movl %2, %%ecx\n"
+        "rep movsl\n"
+        "movl %3, %%ecx\n"
         "rep movsb"
-        : 
-        : "r"(dest), "r"(src), "r"(n)
-        : "edi", "esi", "ecx", "memory"
+        : "+D"(d), "+S"(src), "+c"(dwords)
+        : "r"(tail)
+        : "memory"
     );
     return dest;
 }
 // Use this for Graphics (VESA_flip, VESA_scroll)
 void* kmemcpy32(void* dest, const void* src, uint32_t n) {
+    if (simd_available && n * 4 >= SIMD_MIN_BYTES) return simd_memcpy(dest, src, n * 4);
+
+    void* d = dest;
     __asm__ volatile (
         "rep movsl"
-        : "+D"(dest), "+S"(src), "+c"(n)
+        : "+D"(d), "+S"(src), "+c"(n)
         : : "memory"
     );
     return dest;
@@ -90,12 +216,12 @@ void kheap_stats() {
     uint32_t blocks = 0;
     
     header_t* curr = heap_start;
-    uint32_t heap_limit = (uint32_t)heap_start + 16 * 1024 * 1024; // 1MB limit
+    uint32_t heap_limit = heap_end;
     kprintf("Scanning Heap at 0x%x...\n", (uint32_t)heap_start);
 
     while (curr != NULL) {
         // --- THE SAFETY CHECK ---
-        // If curr is outside the 1MB pool, the list is broken. 
+        // If curr is outside the pool, the list is broken. 
         // Stop here instead of rebooting!
         if ((uint32_t)curr < (uint32_t)heap_start || (uint32_t)curr >= heap_limit) {
             kprintf("Error: Heap linked-list corrupted at 0x%x\n", (uint32_t)curr);
@@ -120,14 +246,20 @@ void kheap_stats() {
     }
 
     kprintf("Blocks: %d | Used: %d | Free: %d\n", blocks, used_mem, free_mem);
+    kprintf("Mapped: %d KB | Peak: %d KB | Limit: %d KB\n",
+        (heap_end - KHEAP_START) / 1024, (heap_high_water - KHEAP_START) / 1024,
+        (KHEAP_MAX - KHEAP_START) / 1024);
 }
 
-void* kmalloc(uint32_t size) {
+static void* kheap_alloc_locked(uint32_t size, uint32_t caller, uint32_t tag) {
     if (size == 0) return NULL;
 
     // 1. ALIGNMENT: 4-byte boundaries are non-negotiable for heap stability
     size = (size + 3) & ~3;
+    if (!heap_start) return NULL;
 
+    int grown = 0;
+retry:;
     header_t* curr = heap_start;
 
     while (curr) {
@@ -164,20 +296,64 @@ void* kmalloc(uint32_t size) {
             
             // 3. LOCK AND RETURN
             curr->is_free = 0;
+            curr->cache_tag = tag;
+#if KHEAP_TRACE
+            curr->caller = caller;
+            curr->tid = get_current_task_id();
+#else
+            (void)caller;
+#endif
             return (void*)((uint32_t)curr + sizeof(header_t));
         }
         
         curr = curr->next;
     }
 
+    // Nothing fits: map more pages at the end and try once more
+    if (!grown && kheap_grow(size + sizeof(header_t))) {
+        grown = 1;
+        goto retry;
+    }
     return NULL; // Truly out of memory
 }
 
+void* kheap_alloc(uint32_t size, uint32_t caller) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    void* ptr = kheap_alloc_locked(size, caller, 0);
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
+}
+
+/**
+ * Carves up to 'count' blocks of 'size' bytes for a magazine refill in
+ * one go. Returns how many we got.
+ */
+uint32_t kheap_alloc_batch(uint32_t size, void** objs, uint32_t count, uint32_t tag) {
+    uint32_t got = 0;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    while (got < count) {
+        void* ptr = kheap_alloc_locked(size, 0, tag);
+        if (!ptr) break;
+        objs[got++] = ptr;
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return got;
+}
+
+void* kmalloc(uint32_t size) {
+    uint32_t caller = (uint32_t)__builtin_return_address(0);
+    if (size && size <= KCACHE_MAX_SIZE) {
+        void* ptr = kcache_alloc(size, caller);
+        if (ptr) return ptr;
+    }
+    return kheap_alloc(size, caller);
+}
+
 void* kmalloc_a(uint32_t size) {
     // 1. We allocate enough extra space to find an aligned spot 
     // without ever moving the actual header.
     uint32_t total_needed = size + 4096; 
-    void* ptr = kmalloc(total_needed);
+    void* ptr = kheap_alloc(total_needed, (uint32_t)__builtin_return_address(0));
     if (!ptr) return NULL;
 
     uint32_t addr = (uint32_t)ptr;
@@ -191,9 +367,12 @@ void* kmalloc_a(uint32_t size) {
     return (void*)aligned_addr;
 }
 void* kmemset(void* dest, uint32_t val, uint32_t n) {
+    if (simd_available && n * 4 >= SIMD_MIN_BYTES) return simd_memset32(dest, val, n);
+
+    void* d = dest;
     __asm__ volatile (
         "rep stosl"
-        : "+D"(dest), "+c"(n)
+        : "+D"(d), "+c"(n)
         : "a"(val)
         : "memory"
     );
@@ -216,6 +395,11 @@ void kheap_dump_map() {
             curr->size, 
             (uint32_t)curr->next
         );
+#if KHEAP_TRACE
+        if (!curr->is_free) {
+            kprintf_unsync("    Caller: 0x%x | TID: %d\n", curr->caller, curr->tid);
+        }
+#endif
 
         total_calculated += sizeof(header_t) + curr->size;
 
@@ -228,3 +412,160 @@ void kheap_dump_map() {
     kprintf_unsync("Total Heap Coverage: %d bytes\n", total_calculated);
     kprintf_unsync("----------------------\n");
 }
+
+/**
+ * Re-attributes a block to a different call site. Helpers that allocate
+ * on behalf of someone else (fat_load_file) use this so HEAPTOP blames
+ * the code that is supposed to free the buffer, not the helper.
+ */
+void kheap_set_caller(void* ptr, void* caller) {
+#if KHEAP_TRACE
+    // ptr came from kmalloc, so its header sits right in front of it
+    uint32_t addr = (uint32_t)ptr;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    if (addr >= KHEAP_START + sizeof(header_t) && addr < heap_end && !(addr & 3)) {
+        header_t* h = KHEAP_HEADER(ptr);
+        // A plain block has no tag, a magazine object has ours
+        int sane = !h->cache_tag || (h->cache_tag & ~KCACHE_CLASS_MASK) == KCACHE_TAG;
+        if (!h->is_free && sane) h->caller = (uint32_t)caller;
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+#else
+    (void)ptr;
+    (void)caller;
+#endif
+}
+
+#if KHEAP_TRACE
+struct heap_site {
+    uint32_t caller;
+    uint32_t bytes;
+    uint32_t blocks;
+    int tid; // -1 once blocks from different tasks share the site
+};
+#endif
+
+// Free block size buckets for the fragmentation histogram; the last one is open-ended
+static const uint32_t frag_limits[] = { 64, 256, 1024, 4096, 16384, 65536, 262144 };
+static const char* frag_names[] = { "<64", "<256", "<1K", "<4K", "<16K", "<64K", "<256K", ">=256K" };
+#define FRAG_BUCKETS 8
+
+static int dec_width(uint32_t v) {
+    int w = 1;
+    while (v >= 10) { v /= 10; w++; }
+    return w;
+}
+
+/**
+ * HEAPTOP: live bytes per call site (biggest first) and a histogram of
+ * the free blocks. Caller addresses can be looked up with addr2line.
+ */
+void kheap_top() {
+    uint32_t hist_count[FRAG_BUCKETS] = {0};
+    uint32_t hist_bytes[FRAG_BUCKETS] = {0};
+    uint32_t free_total = 0, largest_free = 0;
+    uint32_t used_total = 0, used_blocks = 0;
+#if KHEAP_TRACE
+    static struct heap_site sites[KHEAP_TOP_SITES];
+    int site_count = 0;
+    uint32_t other_bytes = 0, other_blocks = 0;
+    uint32_t idle_bytes = 0, idle_blocks = 0;
+#endif
+
+    // 1. One pass over the block list
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    for (header_t* curr = heap_start; curr; curr = curr->next) {
+        if ((uint32_t)curr < (uint32_t)heap_start || (uint32_t)curr >= heap_end) {
+            kprintf_unsync("Error: Heap linked-list corrupted at 0x%x\n", (uint32_t)curr);
+            break;
+        }
+
+        if (curr->is_free) {
+            int b = 0;
+            while (b < FRAG_BUCKETS - 1 && curr->size >= frag_limits[b]) b++;
+            hist_count[b]++;
+            hist_bytes[b] += curr->size;
+            free_total += curr->size;
+            if (curr->size > largest_free) largest_free = curr->size;
+            continue;
+        }
+
+#if KHEAP_TRACE
+        // Sitting in a magazine, nobody owns it right now
+        if (curr->cache_tag && !curr->caller) {
+            idle_bytes += curr->size;
+            idle_blocks++;
+            continue;
+        }
+#endif
+        used_total += curr->size;
+        used_blocks++;
+#if KHEAP_TRACE
+        int s = 0;
+        while (s < site_count && sites[s].caller != curr->caller) s++;
+        if (s == site_count) {
+            if (site_count == KHEAP_TOP_SITES) {
+                other_bytes += curr->size;
+                other_blocks++;
+                continue;
+            }
+            sites[s].caller = curr->caller;
+            sites[s].bytes = 0;
+            sites[s].blocks = 0;
+            sites[s].tid = curr->tid;
+            site_count++;
+        }
+        sites[s].bytes += curr->size;
+        sites[s].blocks++;
+        if (sites[s].tid != (int)curr->tid) sites[s].tid = -1;
+#endif
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    kprintf_unsync("HEAPTOP: %d bytes live in %d blocks\n", used_total, used_blocks);
+
+#if KHEAP_TRACE
+    // 2. Biggest consumers first (insertion sort, there are at most 32)
+    for (int i = 1; i < site_count; i++) {
+        struct heap_site key = sites[i];
+        int j = i - 1;
+        while (j >= 0 && sites[j].bytes < key.bytes) {
+            sites[j + 1] = sites[j];
+            j--;
+        }
+        sites[j + 1] = key;
+    }
+
+    kprintf_unsync("CALLER       BYTES      BLOCKS  TID\n");
+    for (int i = 0; i < site_count; i++) {
+        kprintf_unsync("0x%x   %d", sites[i].caller, sites[i].bytes);
+        for (int pad = dec_width(sites[i].bytes); pad < 11; pad++) kprintf_unsync(" ");
+        kprintf_unsync("%d", sites[i].blocks);
+        for (int pad = dec_width(sites[i].blocks); pad < 8; pad++) kprintf_unsync(" ");
+        if (sites[i].tid < 0) kprintf_unsync("*\n");
+        else kprintf_unsync("%d\n", sites[i].tid);
+    }
+    if (other_blocks) {
+        kprintf_unsync("(other)      %d bytes in %d blocks\n", other_bytes, other_blocks);
+    }
+    kprintf_unsync("(magazines)  %d bytes in %d blocks\n", idle_bytes, idle_blocks);
+#else
+    kprintf_unsync("(per-caller tags disabled, build with KHEAP_TRACE=1)\n");
+#endif
+
+    // 3. Fragmentation: how the free space is chopped up
+    kprintf_unsync("Free blocks by size:\n");
+    for (int b = 0; b < FRAG_BUCKETS; b++) {
+        if (!hist_count[b]) continue;
+        kprintf_unsync("  %s", frag_names[b]);
+        for (int pad = (int)kstrlen(frag_names[b]); pad < 8; pad++) kprintf_unsync(" ");
+        kprintf_unsync("%d blocks, %d bytes\n", hist_count[b], hist_bytes[b]);
+    }
+    // Share of free space that is NOT in the largest block
+    uint32_t l = largest_free, t = free_total;
+    while (t > 0x1000000) { l >>= 4; t >>= 4; } // Keep l * 100 in 32 bits
+    uint32_t frag = t ? 100 - (l * 100) / t : 0;
+    kprintf_unsync("Free: %d | Largest: %d | Fragmentation: %d percent\n", free_total, largest_free, frag);
+
+    kcache_print_stats();
+}
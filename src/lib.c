@@ -2,7 +2,10 @@
 #include <stdarg.h>
 #include "lib.h"
 #include <stddef.h>
-extern int timer_frequency;
+#include "sched.h"
+#include "task.h"
+#include "idt.h"
+#include "clock.h"
 
 int kstrcmp(const char* a, const char* b) {
     while (*a && (*a == *b)) {
@@ -268,9 +271,27 @@ void hexdump(void* ptr, int size) {
     }
 }
 
+/**
+ * Blocks the calling task for at least 'ms'. It sits SLEEPING off the
+ * ready queues, same as syscall 3, until its timer fires.
+ */
 void sleep(int ms) {
-    uint32_t end = system_ticks + (ms / (1000 / timer_frequency));
-    while (system_ticks < end) {
+    if (ms <= 0) return;
+    uint64_t deadline = clock_ns() + (uint64_t)ms * NS_PER_MS;
+
+    if (multitasking_enabled) {
+        // The wheel only wakes on tick boundaries and part of this tick is
+        // already gone, so check the clock and top up with whole ticks
+        uint64_t now;
+        while ((now = clock_ns()) < deadline) {
+            sched_sleep(clock_ns_to_ticks(deadline - now));
+            yield();
+        }
+        return;
+    }
+
+    // Before the scheduler is up there's only us: wait it out
+    while (clock_ns() < deadline) {
         __asm__ volatile("hlt"); // Wait for next interrupt
     }
 }
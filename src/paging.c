@@ -1,41 +1,414 @@
 #include "paging.h"
 #include "vesa.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "lib.h"
+#include "spinlock.h"
+#include "smp.h"
 #include <stdint.h>
+#include <stddef.h>
 // A page directory entry
 uint32_t page_directory[1024] __attribute__((aligned(4096)));
-uint32_t vesa_page_tables[2][1024] __attribute__((aligned(4096)));
-// We define 4 page tables to cover 16MB of RAM (8MB per table)
-uint32_t kernel_page_tables[8][1024] __attribute__((aligned(4096)));
+// Page tables are no longer static arrays: they come from the PMM the first
+// time something is mapped in their 4MB slot. Once paging is on we reach them
+// through the recursive slot (PDE 1023 points back at the directory).
+static int paging_enabled = 0;
+// Set once CR4.PSE is on and 4MB pages are allowed in the directory
+static int pse_enabled = 0;
+
+// Set once PAT entry 1 has been reprogrammed to write-combining
+static int pat_enabled = 0;
+
+// Serializes page table edits; two CPUs may want the same new table
+static spinlock_t paging_lock = SPINLOCK_INIT;
+
+// How many invalidations of each kind we issued (see TLB command)
+struct tlb_flush_stats tlb_stats;
 
 extern void load_page_directory(unsigned int*);
 extern void enable_paging();
 
 /**
- * Maps a virtual address to a physical address in the first 4MB
+ * Where we can touch the table for dir_index right now.
+ * Before paging: its physical address. After: its recursive alias.
  */
-void map_page(uint32_t virtual_addr, uint32_t physical_addr) {
-    uint32_t dir_index = virtual_addr >> 22;
-    uint32_t table_index = (virtual_addr >> 12) & 0x03FF;
+static uint32_t* table_ptr(uint32_t dir_index) {
+    if (!paging_enabled) return (uint32_t*)(page_directory[dir_index] & ~0xFFF);
+    return (uint32_t*)(PAGE_TABLES_VIRT + dir_index * 4096);
+}
+
+/**
+ * Breaks a 4MB page into a table of 1024 small pages with the same
+ * frames and flags, so a single 4KB page inside it can be changed.
+ */
+static uint32_t* split_large_page(uint32_t dir_index) {
+    uint32_t pde = page_directory[dir_index];
+    void* frame = pmm_alloc_page();
+    if (!frame) return NULL;
+
+    // Fill the new table BEFORE it goes live: the 4MB page may be the very
+    // one we are executing from. That means reaching the frame directly,
+    // so it has to come from the identity window once paging is on.
+    if (paging_enabled && (uint32_t)frame >= KERNEL_IDENTITY_LIMIT) {
+        pmm_free_page(frame);
+        return NULL;
+    }
+
+    uint32_t base = pde & 0xFFC00000;
+    uint32_t flags = pde & 0xFFF & ~PAGE_LARGE;
+    if (pde & PAGE_LARGE_PAT) flags |= PAGE_PAT; // PAT moves from bit 12 to bit 7
+    uint32_t* table = (uint32_t*)frame;
+    for (int i = 0; i < 1024; i++) table[i] = (base + i * 4096) | flags;
+    page_directory[dir_index] = (uint32_t)frame | PAGE_PRESENT | PAGE_WRITE;
+
+    // The old 4MB translation is one TLB entry; invlpg anywhere inside it
+    // drops it (and the paging-structure caches along with it)
+    if (paging_enabled) {
+        paging_flush_page(dir_index << 22);
+        paging_flush_page((uint32_t)table_ptr(dir_index));
+    }
+    return table_ptr(dir_index);
+}
+
+/**
+ * Returns the table covering dir_index, allocating a zeroed one from the
+ * PMM if 'create' is set. NULL if it doesn't exist (or we ran out of frames).
+ * A 4MB page in the slot is split so callers always get 4KB granularity.
+ */
+static uint32_t* get_page_table(uint32_t dir_index, int create) {
+    if (dir_index == PAGING_RECURSIVE_SLOT) return NULL; // Never touch the mirror
+
+    if ((page_directory[dir_index] & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE)) {
+        return split_large_page(dir_index);
+    }
+
+    if (!(page_directory[dir_index] & PAGE_PRESENT)) {
+        if (!create) return NULL;
+
+        void* frame = pmm_alloc_page();
+        if (!frame) return NULL;
+        page_directory[dir_index] = (uint32_t)frame | PAGE_PRESENT | PAGE_WRITE;
+
+        // The recursive alias of this table just changed under us
+        uint32_t* table = table_ptr(dir_index);
+        if (paging_enabled) paging_flush_page((uint32_t)table);
+        for (int i = 0; i < 1024; i++) table[i] = 0;
+        return table;
+    }
+    return table_ptr(dir_index);
+}
 
-    // For simplicity, we only allow mapping in the first 4MB table via this function
-    // unless we dynamically allocated more tables.
-    if (dir_index < 4) {
-        kernel_page_tables[dir_index][table_index] = (physical_addr & ~0xFFF) | 3;
+/**
+ * Invalidates the TLB entry of a single page, on this CPU only. Fine for
+ * mappings nobody could have cached yet; anything that was reachable
+ * before goes through paging_flush_range or the paging_* calls below.
+ */
+void paging_flush_page(uint32_t virtual_addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+    tlb_stats.page_flushes++;
+}
+
+/**
+ * Invalidates 'pages' consecutive pages on this CPU. Past
+ * TLB_FLUSH_THRESHOLD pages a CR3 reload is cheaper than the invlpg loop
+ * (and the TLB is mostly wrong by then anyway), so we switch to a full flush.
+ */
+void paging_flush_local(uint32_t virtual_addr, uint32_t pages) {
+    if (!paging_enabled || pages == 0) return;
+
+    if (pages > TLB_FLUSH_THRESHOLD) {
         flush_tlb();
+        return;
+    }
+    for (uint32_t i = 0; i < pages; i++) {
+        __asm__ volatile("invlpg (%0)" : : "r"(virtual_addr + i * 4096) : "memory");
     }
+    tlb_stats.range_flushes++;
+    tlb_stats.range_pages += pages;
+}
+
+// The same on every CPU: other CPUs get a shootdown IPI and we wait for them
+void paging_flush_range(uint32_t virtual_addr, uint32_t pages) {
+    if (!paging_enabled || pages == 0) return;
+    paging_flush_local(virtual_addr, pages);
+    smp_tlb_shootdown(virtual_addr, pages);
+}
+
+// The raw PTE updates. None of these touch the TLB; callers batch that.
+// set_pte (through *old) and clear_pte hand back the entry they replaced.
+static int set_pte(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags, uint32_t* old) {
+    uint32_t lock_flags = spin_lock_irqsave(&paging_lock);
+    uint32_t* table = get_page_table(virtual_addr >> 22, 1);
+    *old = 0;
+    if (table) {
+        uint32_t* entry = &table[(virtual_addr >> 12) & 0x03FF];
+        *old = *entry;
+        *entry = (physical_addr & ~0xFFF) | (flags & 0xFFF) | PAGE_PRESENT;
+    }
+    spin_unlock_irqrestore(&paging_lock, lock_flags);
+    return table ? 0 : -1;
+}
+
+static uint32_t clear_pte(uint32_t virtual_addr) {
+    uint32_t lock_flags = spin_lock_irqsave(&paging_lock);
+    uint32_t old = 0;
+    uint32_t* table = get_page_table(virtual_addr >> 22, 0);
+    if (table) {
+        old = table[(virtual_addr >> 12) & 0x03FF];
+        table[(virtual_addr >> 12) & 0x03FF] = 0;
+    }
+    spin_unlock_irqrestore(&paging_lock, lock_flags);
+    return old;
+}
+
+static int protect_pte(uint32_t virtual_addr, uint32_t flags) {
+    uint32_t lock_flags = spin_lock_irqsave(&paging_lock);
+    int ret = -1;
+    uint32_t* table = get_page_table(virtual_addr >> 22, 0);
+    if (table) {
+        uint32_t* entry = &table[(virtual_addr >> 12) & 0x03FF];
+        if (*entry & PAGE_PRESENT) {
+            *entry = (*entry & ~0xFFF) | (flags & 0xFFF) | PAGE_PRESENT;
+            ret = 0;
+        }
+    }
+    spin_unlock_irqrestore(&paging_lock, lock_flags);
+    return ret;
+}
+
+/**
+ * Maps one 4KB page. 'flags' are the low PTE bits (PAGE_PRESENT is implied).
+ * Returns 0 on success, -1 if no page table could be allocated.
+ */
+int paging_map(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
+    uint32_t old;
+    if (set_pte(virtual_addr, physical_addr, flags, &old) != 0) return -1;
+    if (!paging_enabled) return 0;
+    // Replacing a live mapping (COW, retyping): other CPUs may hold the old one
+    if (old & PAGE_PRESENT) paging_flush_range(virtual_addr, 1);
+    else paging_flush_page(virtual_addr);
+    return 0;
 }
 
 /**
- * Flushes the TLB (Translation Lookaside Buffer) to apply changes immediately
+ * The frame behind virtual_addr may be freed as soon as this returns,
+ * so no CPU may still have it in its TLB.
+ */
+void paging_unmap(uint32_t virtual_addr) {
+    uint32_t old = clear_pte(virtual_addr);
+    if (!paging_enabled) return;
+    if (old & PAGE_PRESENT) paging_flush_range(virtual_addr, 1);
+    else paging_flush_page(virtual_addr);
+}
+
+/**
+ * Rewrites the flags of an already-present page, keeping its frame.
+ * Returns -1 if the page isn't mapped.
+ */
+int paging_protect(uint32_t virtual_addr, uint32_t flags) {
+    if (protect_pte(virtual_addr, flags) != 0) return -1;
+    paging_flush_range(virtual_addr, 1);
+    return 0;
+}
+
+/**
+ * Maps one 4MB page. Both addresses must be 4MB aligned, PSE must be on,
+ * and the slot must not already hold a page table.
+ */
+int paging_map_large(uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags) {
+    uint32_t dir_index = virtual_addr >> 22;
+    if (!pse_enabled || dir_index == PAGING_RECURSIVE_SLOT) return -1;
+    if ((virtual_addr | physical_addr) & 0x3FFFFF) return -1;
+
+    uint32_t pde = page_directory[dir_index];
+    if ((pde & PAGE_PRESENT) && !(pde & PAGE_LARGE)) return -1;
+
+    page_directory[dir_index] = physical_addr | (flags & 0xFFF) | PAGE_PRESENT | PAGE_LARGE;
+    // A 4MB translation is a single TLB entry, one invlpg drops it
+    if (pde & PAGE_PRESENT) paging_flush_range(virtual_addr, 1);
+    else if (paging_enabled) paging_flush_page(virtual_addr);
+    return 0;
+}
+
+/**
+ * Maps [virtual_addr, +size) with 4MB pages wherever a whole aligned 4MB
+ * chunk fits, and 4KB pages for the ragged edges (or everything, without PSE).
+ */
+int paging_map_range_large(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size, uint32_t flags) {
+    uint32_t start = virtual_addr;
+    uint32_t end = virtual_addr + ((size + 0xFFF) & ~0xFFF);
+    uint32_t offset = physical_addr - virtual_addr;
+
+    while (virtual_addr < end) {
+        int aligned = !((virtual_addr | (virtual_addr + offset)) & 0x3FFFFF);
+        if (pse_enabled && aligned && end - virtual_addr >= 0x400000 &&
+            paging_map_large(virtual_addr, virtual_addr + offset, flags) == 0) {
+            virtual_addr += 0x400000;
+            continue;
+        }
+        uint32_t old;
+        if (set_pte(virtual_addr, virtual_addr + offset, flags, &old) != 0) return -1;
+        virtual_addr += 4096;
+    }
+    paging_flush_range(start, (end - start) / 4096);
+    return 0;
+}
+
+int paging_large_pages_enabled() {
+    return pse_enabled;
+}
+
+/**
+ * Range versions. 'size' is rounded up to whole pages. The PTEs are all
+ * written first and the TLB is invalidated once at the end.
+ * On failure paging_map_range undoes what it already mapped.
+ */
+int paging_map_range(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size, uint32_t flags) {
+    uint32_t pages = (size + 0xFFF) / 4096;
+    for (uint32_t i = 0; i < pages; i++) {
+        uint32_t old;
+        if (set_pte(virtual_addr + i * 4096, physical_addr + i * 4096, flags, &old) != 0) {
+            paging_unmap_range(virtual_addr, i * 4096);
+            return -1;
+        }
+    }
+    paging_flush_range(virtual_addr, pages);
+    return 0;
+}
+
+void paging_unmap_range(uint32_t virtual_addr, uint32_t size) {
+    uint32_t pages = (size + 0xFFF) / 4096;
+    for (uint32_t i = 0; i < pages; i++) {
+        clear_pte(virtual_addr + i * 4096);
+    }
+    paging_flush_range(virtual_addr, pages);
+}
+
+int paging_protect_range(uint32_t virtual_addr, uint32_t size, uint32_t flags) {
+    uint32_t pages = (size + 0xFFF) / 4096;
+    int result = 0;
+    for (uint32_t i = 0; i < pages; i++) {
+        if (protect_pte(virtual_addr + i * 4096, flags) != 0) result = -1;
+    }
+    paging_flush_range(virtual_addr, pages);
+    return result;
+}
+
+/**
+ * Raw PTE for virtual_addr, or 0 if there is no table for it.
+ */
+uint32_t paging_get_entry(uint32_t virtual_addr) {
+    // Inside a 4MB page: synthesize what the 4KB entry would look like
+    uint32_t pde = page_directory[virtual_addr >> 22];
+    if ((pde & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE)) {
+        uint32_t flags = pde & 0xFFF & ~PAGE_LARGE;
+        if (pde & PAGE_LARGE_PAT) flags |= PAGE_PAT;
+        return ((pde & 0xFFC00000) + (virtual_addr & 0x3FF000)) | flags;
+    }
+
+    uint32_t* table = get_page_table(virtual_addr >> 22, 0);
+    if (!table) return 0;
+    return table[(virtual_addr >> 12) & 0x03FF];
+}
+
+/**
+ * Walks the tables by hand. Returns 0 if the page is not present.
+ */
+uint32_t paging_get_phys(uint32_t virtual_addr) {
+    uint32_t entry = paging_get_entry(virtual_addr);
+    if (!(entry & PAGE_PRESENT)) return 0;
+    return (entry & ~0xFFF) | (virtual_addr & 0xFFF);
+}
+
+// Old names, still used all over the place
+int map_page(uint32_t virtual_addr, uint32_t physical_addr) {
+    return paging_map(virtual_addr, physical_addr, PAGE_WRITE);
+}
+
+void unmap_page(uint32_t virtual_addr) {
+    paging_unmap(virtual_addr);
+}
+
+/**
+ * Flushes the TLB (Translation Lookaside Buffer) to apply changes immediately.
+ * This throws away EVERY translation, framebuffer and kernel included,
+ * so prefer paging_flush_page / paging_flush_range.
  */
 void flush_tlb() {
     uint32_t reg;
     __asm__ volatile("mov %%cr3, %0" : "=r"(reg));
     __asm__ volatile("mov %0, %%cr3" : : "r"(reg));
+    tlb_stats.full_flushes++;
+}
+
+/**
+ * Reprograms PAT entry 1 (the one selected by PWT alone, write-through by
+ * default) to write-combining. Nothing in the kernel asks for WT, so after
+ * this PAGE_PWT on a mapping means "WC". Must run before paging is on.
+ */
+static void paging_init_pat() {
+    if (!cpu_has(CPU_FEATURE_PAT) || !cpu_has(CPU_FEATURE_MSR)) return;
+
+    uint64_t pat = rdmsr(MSR_PAT);
+    pat &= ~(0xFFULL << 8);
+    pat |= (uint64_t)MEMTYPE_WC << 8;
+
+    wbinvd();
+    wrmsr(MSR_PAT, pat);
+    wbinvd();
+    pat_enabled = 1;
 }
 
 /**
- * Initializes paging by identity mapping the first 16MB of RAM
+ * Switches an existing mapping between write-back and write-combining.
+ * 4MB pages are retyped whole instead of being split.
+ * Returns -1 if the CPU has no PAT (caller may fall back to MTRRs).
+ */
+int paging_set_write_combining(uint32_t virtual_addr, uint32_t size, int enable) {
+    if (!pat_enabled) return -1;
+
+    uint32_t start = virtual_addr & ~0xFFF;
+    uint32_t end = virtual_addr + size;
+    uint32_t addr = start;
+    while (addr < end) {
+        uint32_t* pde = &page_directory[addr >> 22];
+        if ((*pde & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE)) {
+            *pde &= ~(PAGE_PWT | PAGE_PCD | PAGE_LARGE_PAT);
+            if (enable) *pde |= PAGE_PWT;
+            addr = (addr & 0xFFC00000) + 0x400000;
+            continue;
+        }
+
+        uint32_t entry = paging_get_entry(addr);
+        if (entry & PAGE_PRESENT) {
+            uint32_t flags = entry & 0xFFF & ~(PAGE_PWT | PAGE_PCD | PAGE_PAT);
+            if (enable) flags |= PAGE_PWT;
+            protect_pte(addr, flags);
+        }
+        addr += 4096;
+    }
+
+    // New memory type: drop the old translations and any lines cached
+    // under the old type so the two never alias.
+    paging_flush_range(start, (addr - start) / 4096);
+    wbinvd();
+    return 0;
+}
+
+int paging_pat_enabled() {
+    return pat_enabled;
+}
+
+void paging_print_stats() {
+    kprintf_unsync("TLB: %d invlpg | %d ranges (%d pages) | %d full (threshold %d pages)\n",
+        tlb_stats.page_flushes, tlb_stats.range_flushes, tlb_stats.range_pages,
+        tlb_stats.full_flushes, TLB_FLUSH_THRESHOLD);
+    kprintf_unsync("Large pages: %s\n", pse_enabled ? "on" : "off");
+}
+
+/**
+ * Initializes paging: identity map the low 32MB and the framebuffer,
+ * everything else is mapped on demand later.
  */
 void paging_init(struct multiboot_info* mbi) {
     // 1. Clear Page Directory
@@ -43,39 +416,45 @@ void paging_init(struct multiboot_info* mbi) {
         page_directory[i] = 0x00000002; // Not present, writable
     }
 
-    // 2. Identity Map the first 32MB (Increased from 16MB)
-    // This ensures your Heap has plenty of mapped physical RAM.
-    for (int t = 0; t < 8; t++) { // 8 tables * 4MB = 32MB
-        for (int i = 0; i < 1024; i++) {
-            uint32_t phys = (t * 4 * 1024 * 1024) + (i * 4096);
-            kernel_page_tables[t][i] = phys | 3; // Present + Writable
-        }
-        page_directory[t] = ((uint32_t)kernel_page_tables[t]) | 3;
+    // 2. Turn on 4MB pages if the CPU has them. The kernel window and the
+    // framebuffer are big, flat, and hammered by memcpy: 8 + 1 TLB entries
+    // instead of thousands.
+    if (cpu_has(CPU_FEATURE_PSE)) {
+        write_cr4(read_cr4() | CR4_PSE);
+        pse_enabled = 1;
     }
 
-    // 3. Identity Map the VESA Framebuffer (Hardware VRAM)
+    // Cache types: make PWT mean write-combining (used by the framebuffer)
+    paging_init_pat();
+
+    // 3. Identity Map the first 32MB so the kernel, the PMM bitmap and
+    // the boot structures keep working once paging is on.
+    paging_map_range_large(0, 0, KERNEL_IDENTITY_LIMIT, PAGE_WRITE);
+
+    // 4. Identity Map the VESA Framebuffer (Hardware VRAM).
+    // VRAM BARs are naturally aligned to a power of two far bigger than
+    // one mode's worth, so if the base is 4MB aligned we can safely round
+    // the mapping up to whole 4MB pages. Otherwise map exactly its size.
     uint32_t fb_phys = (uint32_t)mbi->framebuffer_addr;
-    uint32_t dir_idx_start = fb_phys >> 22;
-    
-    // Map exactly what we need (2 tables = 8MB coverage)
-    for (int t = 0; t < 2; t++) {
-        for (int i = 0; i < 1024; i++) {
-            // FIX: Use 4096 as the increment, not a 4MB jump inside the table loop
-            uint32_t phys_offset = (t * 1024 * 4096) + (i * 4096);
-            uint32_t actual_phys = fb_phys + phys_offset;
-            vesa_page_tables[t][i] = (actual_phys & ~0xFFF) | 3;
-        }
-        
-        if ((dir_idx_start + t) < 1024) {
-            page_directory[dir_idx_start + t] = ((uint32_t)vesa_page_tables[t]) | 3;
-        }
+    uint32_t fb_size = mbi->framebuffer_pitch * mbi->framebuffer_height;
+    if (pse_enabled && !(fb_phys & 0x3FFFFF)) {
+        fb_size = (fb_size + 0x3FFFFF) & ~0x3FFFFF;
     }
-    // 4. Load and Enable
+    paging_map_range_large(fb_phys & ~0xFFF, fb_phys & ~0xFFF, fb_size + (fb_phys & 0xFFF), PAGE_WRITE);
+
+    // 5. The recursive slot: the directory doubles as the table for the
+    // top 4MB, which makes every page table visible at PAGE_TABLES_VIRT.
+    page_directory[PAGING_RECURSIVE_SLOT] = (uint32_t)page_directory | PAGE_PRESENT | PAGE_WRITE;
+
+    // 6. Load and Enable
     load_page_directory(page_directory);
     enable_paging();
+    paging_enabled = 1;
+
+    // Make read-only pages bind ring 0 too; copy-on-write images rely on it
+    write_cr0(read_cr0() | CR0_WP);
 
     __asm__ volatile("sti"); 
 
     // Use VESA_print sparingly here, as the backbuffer might not be ready yet
 }
-
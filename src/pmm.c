@@ -1,50 +1,196 @@
 #include <stdint.h>
 #include "pmm.h"
+#include "multiboot.h"
+#include "spinlock.h"
+#include "smp.h"
 uint32_t* bitmap;
 uint32_t total_pages;
+uint32_t bitmap_words;           // Number of 32-bit words backing the bitmap
+static uint32_t free_pages = 0;  // Running count so STAT never has to scan
+// Every word BELOW this index is known to be full (0xFFFFFFFF).
+// Allocation pushes it forward, freeing pulls it back.
+static uint32_t next_free_hint = 0;
+// Stack faults on different CPUs allocate at the same time
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+// Index of the lowest set bit. Caller must guarantee val != 0.
+static inline uint32_t bsf(uint32_t val) {
+    uint32_t idx;
+    __asm__("bsf %1, %0" : "=r"(idx) : "rm"(val));
+    return idx;
+}
 
 // Define this first!
 void pmm_set_page(uint32_t page_addr) {
     uint32_t frame = page_addr / 4096;
+    if (frame >= total_pages) return;
+
     uint32_t idx = frame / 32;
-    uint32_t off = frame % 32;
-    bitmap[idx] |= (1 << off);
+    uint32_t bit = 1 << (frame % 32);
+    if (!(bitmap[idx] & bit)) {
+        bitmap[idx] |= bit;
+        free_pages--;
+    }
+}
+
+void pmm_clear_page(uint32_t page_addr) {
+    uint32_t frame = page_addr / 4096;
+    if (frame >= total_pages) return;
+
+    uint32_t idx = frame / 32;
+    uint32_t bit = 1 << (frame % 32);
+    if (bitmap[idx] & bit) {
+        bitmap[idx] &= ~bit;
+        free_pages++;
+        if (idx < next_free_hint) next_free_hint = idx;
+    }
+}
+
+// Linker symbols bracketing the kernel image (see linker.ld)
+extern char kernel_start;
+extern char end;
+
+#define PAGE_ALIGN_UP(x) (((x) + 0xFFF) & ~0xFFF)
+
+// Mark every frame touched by [start, end) as used
+static void pmm_reserve_range(uint32_t start, uint32_t end) {
+    for (uint64_t addr = start & ~0xFFF; addr < end; addr += 4096) {
+        pmm_set_page((uint32_t)addr);
+    }
 }
 
-void pmm_init(uint32_t mem_size, uint32_t bitmap_start) {
-    total_pages = mem_size / 4096;
-    bitmap = (uint32_t*)bitmap_start;
+// Free only the frames that lie COMPLETELY inside a usable region
+static void pmm_release_range(uint64_t start, uint64_t len) {
+    uint64_t first = (start + 0xFFF) / 4096;
+    uint64_t last = (start + len) / 4096;
+    if (last > total_pages) last = total_pages;
+    for (uint64_t frame = first; frame < last; frame++) {
+        pmm_clear_page((uint32_t)frame * 4096);
+    }
+}
+
+// If [place, place + size) collides with [start, end), bump it past the end
+static uint32_t pmm_skip_over(uint32_t place, uint32_t size, uint32_t start, uint32_t end) {
+    if (place < end && place + size > start) return PAGE_ALIGN_UP(end);
+    return place;
+}
+
+void pmm_init(struct multiboot_info* mbi) {
+    struct multiboot_mmap_entry* mmap = (struct multiboot_mmap_entry*)mbi->mmap_addr;
+    uint32_t mmap_end = mbi->mmap_addr + mbi->mmap_length;
+    int have_mmap = mbi->flags & MULTIBOOT_INFO_MEM_MAP;
+    struct multiboot_module* mods = (struct multiboot_module*)mbi->mods_addr;
+    uint32_t mods_count = (mbi->flags & MULTIBOOT_INFO_MODS) ? mbi->mods_count : 0;
+
+    // 1. Find the top of usable RAM. Without PAE we can't reach past 4GB.
+    uint64_t top = 0;
+    if (have_mmap) {
+        for (struct multiboot_mmap_entry* e = mmap; (uint32_t)e < mmap_end;
+             e = (struct multiboot_mmap_entry*)((uint32_t)e + e->size + 4)) {
+            if (e->type != MULTIBOOT_MEMORY_AVAILABLE || e->addr >= 0x100000000ULL) continue;
+            uint64_t region_end = e->addr + e->len;
+            if (region_end > 0x100000000ULL) region_end = 0x100000000ULL;
+            if (region_end > top) top = region_end;
+        }
+    } else {
+        // Old loaders only give us mem_upper (KB above 1MB)
+        top = ((uint64_t)mbi->mem_upper + 1024) * 1024;
+    }
+    total_pages = (uint32_t)(top / 4096);
+    bitmap_words = (total_pages + 31) / 32;
+
+    // 2. Place the bitmap right after the kernel, but never on top of the
+    // boot modules or the multiboot structures we still need to read.
+    uint32_t placement = PAGE_ALIGN_UP((uint32_t)&end);
+    for (uint32_t i = 0; i < mods_count; i++) {
+        if (mods[i].mod_end > placement) placement = PAGE_ALIGN_UP(mods[i].mod_end);
+    }
+    uint32_t bitmap_size = bitmap_words * 4;
+    for (int pass = 0; pass < 3; pass++) {
+        placement = pmm_skip_over(placement, bitmap_size, (uint32_t)mbi, (uint32_t)mbi + sizeof(*mbi));
+        if (have_mmap) placement = pmm_skip_over(placement, bitmap_size, mbi->mmap_addr, mmap_end);
+        if (mods_count) placement = pmm_skip_over(placement, bitmap_size, mbi->mods_addr,
+                                                  mbi->mods_addr + mods_count * sizeof(struct multiboot_module));
+    }
+    bitmap = (uint32_t*)placement;
 
-    // Clear bitmap (free all memory)
-    for (uint32_t i = 0; i < total_pages / 32; i++) {
-        bitmap[i] = 0;
+    // 3. Everything starts out USED. Only what the firmware calls usable
+    // gets released, so holes (ACPI, MMIO, ROMs) can never be handed out.
+    for (uint32_t i = 0; i < bitmap_words; i++) {
+        bitmap[i] = 0xFFFFFFFF;
     }
-    
-    // Mark the kernel and the bitmap itself as used
-    // We'll mark the first 4MB as used just to be safe for now
-    for (uint32_t i = 0; i < 1024; i++) {
-        pmm_set_page(i * 4096);
+    free_pages = 0;
+    next_free_hint = bitmap_words;
+
+    if (have_mmap) {
+        for (struct multiboot_mmap_entry* e = mmap; (uint32_t)e < mmap_end;
+             e = (struct multiboot_mmap_entry*)((uint32_t)e + e->size + 4)) {
+            if (e->type == MULTIBOOT_MEMORY_AVAILABLE) pmm_release_range(e->addr, e->len);
+        }
+    } else {
+        pmm_release_range(0x100000, (uint64_t)mbi->mem_upper * 1024);
     }
+
+    // 4. Take back exactly what is already in use
+    pmm_set_page(0); // Keep NULL a bad pointer
+    pmm_set_page(AP_TRAMPOLINE); // APs start in real mode from here (smp.c)
+    pmm_reserve_range((uint32_t)&kernel_start, (uint32_t)&end);
+    pmm_reserve_range(placement, placement + bitmap_size);
+    pmm_reserve_range((uint32_t)mbi, (uint32_t)mbi + sizeof(*mbi));
+    if (have_mmap) pmm_reserve_range(mbi->mmap_addr, mmap_end);
+    if (mods_count) {
+        pmm_reserve_range(mbi->mods_addr, mbi->mods_addr + mods_count * sizeof(struct multiboot_module));
+        for (uint32_t i = 0; i < mods_count; i++) {
+            pmm_reserve_range(mods[i].mod_start, mods[i].mod_end);
+        }
+    }
+    if (mbi->flags & MULTIBOOT_INFO_FRAMEBUF) {
+        // Usually MMIO above RAM, but some firmware carves it out of RAM
+        uint32_t fb = (uint32_t)mbi->framebuffer_addr;
+        pmm_reserve_range(fb, fb + mbi->framebuffer_pitch * mbi->framebuffer_height);
+    }
+}
+
+int pmm_is_free(uint32_t page_addr) {
+    uint32_t frame = page_addr / 4096;
+    if (frame >= total_pages) return 0;
+    return !(bitmap[frame / 32] & (1 << (frame % 32)));
 }
 // Returns the index of the first free bit (0) found in the bitmap
 int pmm_find_free() {
-    for (uint32_t i = 0; i < total_pages / 32; i++) {
+    if (free_pages == 0) return -1; // Out of memory!
+
+    // Skip the full prefix in one go, then let BSF pick the bit.
+    for (uint32_t i = next_free_hint; i < bitmap_words; i++) {
         if (bitmap[i] != 0xFFFFFFFF) { // If this uint32 is not full
-            for (int j = 0; j < 32; j++) {
-                uint32_t bit = 1 << j;
-                if (!(bitmap[i] & bit)) {
-                    return i * 32 + j;
-                }
-            }
+            next_free_hint = i;
+            return i * 32 + bsf(~bitmap[i]);
         }
     }
+    next_free_hint = bitmap_words;
     return -1; // Out of memory!
 }
 
 void* pmm_alloc_page() {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
     int frame = pmm_find_free();
-    if (frame == -1) return 0;
+    if (frame != -1) pmm_set_page(frame * 4096);
+    spin_unlock_irqrestore(&pmm_lock, flags);
 
-    pmm_set_page(frame * 4096);
+    if (frame == -1) return 0;
     return (void*)(frame * 4096);
 }
+
+void pmm_free_page(void* page) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    pmm_clear_page((uint32_t)page);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+uint32_t pmm_get_free_pages() {
+    return free_pages;
+}
+
+uint32_t pmm_get_total_pages() {
+    return total_pages;
+}
@@ -0,0 +1,404 @@
+#include "sched.h"
+#include "task.h"
+#include "tickless.h"
+#include "spinlock.h"
+#include "smp.h"
+#include "idt.h"
+#include "wait.h"
+#include "clock.h"
+#include "simd.h"
+#include <stddef.h>
+
+/*
+ * The running task is never on a ready queue: it's dequeued when it gets
+ * the CPU and put back at the tail when it is preempted or yields while
+ * still READY. Sleeping and dead tasks simply aren't queued, so picking
+ * the next task never looks at them. Only yield() blocks: a task that is
+ * SLEEPING but gets preempted before its yield (between wait_prepare or
+ * sched_sleep and the yield) is still runnable and goes back on a queue.
+ *
+ * Levels work as a multi-level feedback queue: a task runs for its
+ * level's quantum before the next one at that level gets a turn, and
+ * once it has used up the level's allotment (however many times it
+ * yielded along the way) it drops a level. Waking from keyboard input
+ * puts it back at its base level, and so does the periodic boost.
+ *
+ * Every CPU has its own set of queues. A task goes back to the queues of
+ * the CPU it last ran on (t->cpu); a CPU that runs dry steals from the
+ * others. t->priority and t->queued belong to rqs[t->cpu].lock.
+ */
+
+struct ready_queue {
+    struct task* head;
+    struct task* tail;
+};
+
+struct runqueue {
+    spinlock_t lock;
+    struct ready_queue queues[SCHED_LEVELS];
+    uint32_t ready_levels; // Bit n set = queues[n] not empty
+};
+
+static struct runqueue rqs[MAX_CPUS];
+static uint32_t boost_clock = 0;  // Ticks since the last global boost (boot CPU)
+
+// Longer slices further down: CPU hogs switch less, interactive tasks wait less
+static const uint32_t level_quantum[SCHED_LEVELS]   = { 1, 2, 4, 8 };
+// Ticks a task may use at a level before it's demoted; 0 = bottom, stays
+static const uint32_t level_allotment[SCHED_LEVELS] = { 4, 8, 16, 0 };
+
+static struct task* tcb(int tid) {
+    return task_find(tid);
+}
+
+static void queue_push(struct runqueue* rq, struct task* t) {
+    struct ready_queue* q = &rq->queues[t->priority];
+    t->rq_next = NULL;
+    t->rq_prev = q->tail;
+    if (q->tail) q->tail->rq_next = t;
+    else q->head = t;
+    q->tail = t;
+    t->queued = 1;
+    rq->ready_levels |= 1u << t->priority;
+}
+
+static void queue_remove(struct runqueue* rq, struct task* t) {
+    struct ready_queue* q = &rq->queues[t->priority];
+    if (t->rq_prev) t->rq_prev->rq_next = t->rq_next;
+    else q->head = t->rq_next;
+    if (t->rq_next) t->rq_next->rq_prev = t->rq_prev;
+    else q->tail = t->rq_prev;
+    t->rq_next = t->rq_prev = NULL;
+    t->queued = 0;
+    if (!q->head) rq->ready_levels &= ~(1u << t->priority);
+}
+
+// Anything READY on a level above 'level'?
+static int higher_ready(struct runqueue* rq, uint32_t level) {
+    return (rq->ready_levels & ((1u << level) - 1)) != 0;
+}
+
+// Fresh start at the task's base level
+static void reset_level(struct task* t) {
+    t->priority = t->base_priority;
+    t->allotment_used = 0;
+    t->slice_left = level_quantum[t->priority];
+}
+
+// Head of the highest non-empty level, or NULL
+static struct task* queue_pop(struct runqueue* rq) {
+    if (!rq->ready_levels) return NULL;
+    uint32_t level;
+    __asm__("bsf %1, %0" : "=r"(level) : "r"(rq->ready_levels));
+    struct task* t = rq->queues[level].head;
+    queue_remove(rq, t);
+    return t;
+}
+
+/**
+ * Locks the runqueue 't' belongs to. t->cpu only changes under the old
+ * queue's lock, so check it again once we hold one.
+ */
+static struct runqueue* task_rq_lock(struct task* t, uint32_t* flags) {
+    while (1) {
+        *flags = irq_save();
+        struct runqueue* rq = &rqs[t->cpu];
+        spin_lock(&rq->lock);
+        if (rq == &rqs[t->cpu]) return rq;
+        spin_unlock(&rq->lock);
+        irq_restore(*flags);
+    }
+}
+
+static void task_rq_unlock(struct runqueue* rq, uint32_t flags) {
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+static int is_idle(struct task* t) {
+    return t == cpus[t->cpu].idle;
+}
+
+// Makes 'idle' the idle task of the CPU we run on
+void sched_init(int idle) {
+    struct task* t = tcb(idle);
+    sched_dequeue(idle);
+    this_cpu()->idle = t;
+}
+
+int sched_get_idle() {
+    return this_cpu()->idle ? this_cpu()->idle->tid : -1;
+}
+
+int sched_is_idle(int tid) {
+    struct task* t = tcb(tid);
+    return t && is_idle(t);
+}
+
+// Puts a READY task at the tail of its level, on the CPU it last ran on
+void sched_enqueue(int tid) {
+    struct task* t = tcb(tid);
+    if (!t) return;
+    uint32_t flags;
+    struct runqueue* rq = task_rq_lock(t, &flags);
+    if (!t->queued && !t->kill_pending && !is_idle(t) && cpus[t->cpu].current != t) {
+        if (t->priority >= SCHED_LEVELS) t->priority = SCHED_LEVELS - 1;
+        if (!t->slice_left) t->slice_left = level_quantum[t->priority];
+        t->queued_at = clock_ns();
+        queue_push(rq, t);
+    }
+    task_rq_unlock(rq, flags);
+}
+
+void sched_dequeue(int tid) {
+    struct task* t = tcb(tid);
+    if (!t) return;
+    uint32_t flags;
+    struct runqueue* rq = task_rq_lock(t, &flags);
+    if (t->queued) queue_remove(rq, t);
+    task_rq_unlock(rq, flags);
+}
+
+// SLEEPING -> READY. Zombies stay dead.
+void sched_wake(int tid) {
+    struct task* t = tcb(tid);
+    if (!t || t->state == TASK_ZOMBIE) return;
+    t->state = TASK_READY;
+    sched_enqueue(tid);
+}
+
+// A task's timer is cancelled before its TCB goes, so 'arg' is still live
+static void sleep_expired(void* arg) {
+    struct task* t = (struct task*)arg;
+    if (t->state == TASK_SLEEPING) sched_wake(t->tid);
+}
+
+/**
+ * Marks the current task SLEEPING and arms its wakeup 'ticks' from now.
+ * The caller still has to get off the CPU through schedule().
+ */
+void sched_sleep(uint32_t ticks) {
+    // A tick in between would take us off the CPU with no wakeup armed
+    uint32_t flags = irq_save();
+    struct task* cur = current_task;
+    if (cur->state == TASK_ZOMBIE) {
+        irq_restore(flags);
+        return;
+    }
+    cur->state = TASK_SLEEPING;
+    timer_setup(&cur->sleep_timer, sleep_expired, cur);
+    timer_add(&cur->sleep_timer, ticks);
+    irq_restore(flags);
+}
+
+// Rounded up, so a sleep is never shorter than asked (one tick minimum)
+uint32_t sched_ms_to_ticks(uint32_t ms) {
+    uint32_t ticks = (ms * timer_frequency + 999) / 1000;
+    return ticks ? ticks : 1;
+}
+
+/**
+ * Back to the base level with a fresh allotment. Called when a task
+ * comes back from waiting on input, and for everyone by the periodic boost.
+ */
+static void boost(struct task* t) {
+    if (is_idle(t)) return;
+    uint32_t flags;
+    struct runqueue* rq = task_rq_lock(t, &flags);
+    int queued = t->queued;
+    if (queued) queue_remove(rq, t);
+    reset_level(t);
+    if (queued) queue_push(rq, t);
+    task_rq_unlock(rq, flags);
+}
+
+/**
+ * Timer IRQ side: charges 'ticks' to the running task and demotes it
+ * when its allotment at this level is gone. The boot CPU also drives
+ * the boost.
+ */
+void sched_tick(uint32_t ticks) {
+    struct cpu_local* cpu = this_cpu();
+    if (cpu->id == 0) {
+        boost_clock += ticks;
+        if (boost_clock >= SCHED_BOOST_TICKS) {
+            boost_clock = 0;
+            for (struct task* t = task_iter(NULL); t; t = task_iter(t)) boost(t);
+        }
+    }
+
+    struct task* t = cpu->current;
+    if (t == cpu->idle || t->state != TASK_READY) return;
+
+    struct runqueue* rq = &rqs[cpu->id];
+    spin_lock(&rq->lock);
+    t->slice_left = (t->slice_left > ticks) ? t->slice_left - ticks : 0;
+    t->allotment_used += ticks;
+    uint32_t allot = level_allotment[t->priority];
+    if (allot && t->allotment_used >= allot) {
+        // Not queued while it runs, so the level can change under it
+        t->priority++;
+        t->allotment_used = 0;
+        t->slice_left = 0;
+    }
+    spin_unlock(&rq->lock);
+}
+
+void sched_boost(int tid) {
+    struct task* t = tcb(tid);
+    if (t) boost(t);
+}
+
+// NICE: 0 is the most favoured level. Returns -1 for a bad tid or level.
+int sched_set_nice(int tid, uint32_t level) {
+    struct task* t = task_pin(tid); // A tid off the command line may be dying
+    if (!t) return -1;
+    int ok = !is_idle(t) && level < SCHED_LEVELS;
+    if (ok) {
+        t->base_priority = level;
+        boost(t);
+    }
+    task_unpin(t);
+    return ok ? 0 : -1;
+}
+
+/**
+ * CPU time so far, including the slice it's in the middle of if some CPU
+ * is running it right now. run_ns and exec_start change in
+ * account_switch, under that CPU's queue lock, so read them under it too.
+ */
+uint64_t sched_runtime_ns(struct task* t) {
+    uint32_t flags;
+    struct runqueue* rq = task_rq_lock(t, &flags);
+    uint64_t ns = t->run_ns;
+    if (cpus[t->cpu].current == t) ns += clock_ns() - t->exec_start;
+    task_rq_unlock(rq, flags);
+    return ns;
+}
+
+/**
+ * Work stealing: take the most important queued task off another CPU.
+ * Trylock only, we already hold our own queue. Tasks still on their old
+ * CPU's stack (on_cpu) are skipped.
+ */
+static struct task* steal(int me) {
+    for (int i = 1; i < cpu_count; i++) {
+        int victim = (me + i) % cpu_count;
+        struct runqueue* rq = &rqs[victim];
+        if (!rq->ready_levels || !spin_trylock(&rq->lock)) continue;
+
+        struct task* found = NULL;
+        for (int level = 0; level < SCHED_LEVELS && !found; level++) {
+            for (struct task* t = rq->queues[level].head; t; t = t->rq_next) {
+                if (!t->on_cpu) {
+                    found = t;
+                    break;
+                }
+            }
+        }
+        if (found) {
+            queue_remove(rq, found);
+            found->cpu = me;
+        }
+        spin_unlock(&rq->lock);
+        if (found) {
+            cpus[me].steals++;
+            return found;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Charges the CPU time 'prev' just used, and the queue time 'next' just
+ * waited. Preempted means it could have kept running; everything else
+ * (blocking, sleeping, yield, exit) counts as giving the CPU up.
+ */
+static void account_switch(struct task* prev, struct task* next, int preempted) {
+    uint64_t now = clock_ns();
+    prev->run_ns += now - prev->exec_start;
+    if (preempted) prev->nivcsw++;
+    else prev->nvcsw++;
+
+    if (next->queued_at) {
+        next->wait_ns += now - next->queued_at;
+        next->queued_at = 0;
+    }
+    next->exec_start = now;
+}
+
+/**
+ * The one switch point: timer tick, sleep and exit all end up here.
+ * Saves 'esp' as the current task's context, requeues it if it can
+ * still run, and returns the stack of whoever runs next (0 = keep going).
+ * Interrupts are off.
+ */
+uint32_t schedule(uint32_t esp) {
+    struct cpu_local* cpu = this_cpu();
+    struct runqueue* rq = &rqs[cpu->id];
+    struct task* cur = cpu->current;
+    cur->esp = esp;
+    int yielded = cur->yielding;
+    cur->yielding = 0;
+
+    spin_lock(&rq->lock);
+    // Killed from another CPU while it ran: it goes no further than here
+    if (cur->kill_pending && cur->state != TASK_ZOMBIE) task_make_zombie(cur);
+    // Not yielded, so a SLEEPING task hasn't reached its yield() yet
+    int runnable = cur != cpu->idle &&
+        (cur->state == TASK_READY || (cur->state == TASK_SLEEPING && !yielded));
+    if (runnable) {
+        // Keep the CPU if nothing at our level or above is waiting, or if
+        // the quantum isn't used up and nothing above us is
+        int keep = !higher_ready(rq, cur->priority + 1) ||
+            (!yielded && cur->slice_left && !higher_ready(rq, cur->priority));
+        if (!cur->slice_left) cur->slice_left = level_quantum[cur->priority];
+        if (keep) {
+            spin_unlock(&rq->lock);
+            return 0;
+        }
+    }
+
+    struct task* next = queue_pop(rq);
+    if (!next && !runnable) next = steal(cpu->id);
+    if (!next) {
+        // Nobody waiting: keep going if we can, otherwise idle
+        next = runnable ? cur : cpu->idle;
+    } else if (runnable) {
+        cur->queued_at = clock_ns();
+        queue_push(rq, cur);
+    }
+
+    if (next != cur) {
+        // 'cur' is still on this stack until schedule_tail; nobody may steal it before
+        next->on_cpu = 1;
+        next->cpu = cpu->id;
+        cpu->prev = cur;
+        account_switch(cur, next, runnable && !yielded);
+        fpu_switch_out(cur);
+    }
+    cpu->current = next;
+    spin_unlock(&rq->lock);
+
+    // Nothing runnable anywhere: let the PIT sleep until the next timer is due
+    if (next == cpu->idle && cpu->id == 0 && smp_others_idle()) tickless_enter();
+
+    if (next == cur) return 0;
+    return next->esp;
+}
+
+// Called by the interrupt stubs right after they moved onto the new stack
+void schedule_tail() {
+    struct cpu_local* cpu = this_cpu();
+    struct task* prev = cpu->prev;
+    if (prev) {
+        // A killed task may have armed a sleep or queued a wait after
+        // kill_task cleaned up; drop those before the reaper can free it
+        if (prev->kill_pending) {
+            timer_cancel(&prev->sleep_timer);
+            wait_remove(prev);
+        }
+        prev->on_cpu = 0;
+        cpu->prev = NULL;
+    }
+}
@@ -9,6 +9,14 @@
 #include "idt.h"
 #include "fat.h"
 #include "KED.h"
+#include "paging.h"
+#include "simd.h"
+#include "image.h"
+#include "tickless.h"
+#include "sched.h"
+#include "smp.h"
+#include "clock.h"
+#include "syscall.h"
 
 extern int vesa_updating;
 extern uint32_t system_ticks;
@@ -47,7 +55,7 @@ void execute_command(char* input) {
     int start_y = vesa_cursor_y;
     vesa_updating = 1;
     if (kstrcmp(input, "HELP") == 0) {
-        kprintf_unsync("Commands: LS CD CAT MKDIR PWD TOUCH CLEAR STAT PS KILL SLEEP RUN TOP UPTIME REBOOT CRASH ECHO SET_FPS TIMER GAME TEST_MALLOC HEXDUMP WRITE\n");
+        kprintf_unsync("Commands: LS CD CAT MKDIR PWD TOUCH CLEAR STAT PS KILL SLEEP RUN TOP UPTIME REBOOT CRASH ECHO SET_FPS TIMER GAME TEST_MALLOC HEXDUMP WRITE TLB WC MEMBENCH HEAPTOP IMAGES TICKLESS NICE CPUS SYSCALLS\n");
     }
 else if (kstrcmp(input, "CAT") == 0) {
     if (arg) {
@@ -158,6 +166,44 @@ else if (kstrcmp(input, "SET_FPS") == 0) {
     else if (kstrcmp(input, "STAT") == 0) {
         // Assuming kheap_stats now uses unsync internal prints
         kheap_stats();  
+        kprintf_unsync("Frames: %d free of %d (%d KB free)\n",
+            pmm_get_free_pages(), pmm_get_total_pages(), pmm_get_free_pages() * 4);
+    }
+    else if (kstrcmp(input, "TLB") == 0) {
+        paging_print_stats();
+    }
+    else if (kstrcmp(input, "WC") == 0) {
+        // WC ON / WC OFF switch the framebuffer type, plain WC just measures
+        if (arg && (kstrcmp(arg, "ON") == 0 || kstrcmp(arg, "OFF") == 0)) {
+            if (VESA_set_write_combining(kstrcmp(arg, "ON") == 0) != 0) {
+                kprintf_unsync("WC: no PAT, and no free MTRR (or more than one CPU)\n");
+            }
+        }
+        kprintf_unsync("Framebuffer: %s (%s)\n",
+            VESA_get_write_combining() ? "write-combining" : "write-back",
+            paging_pat_enabled() ? "PAT" : "MTRR");
+        kprintf_unsync("Flip: %d kcycles avg over 8\n", VESA_time_flip(8) / 1000);
+    }
+    else if (kstrcmp(input, "MEMBENCH") == 0) {
+        simd_benchmark();
+        fpu_print_stats();
+    }
+    else if (kstrcmp(input, "HEAPTOP") == 0) {
+        kheap_top();
+    }
+    else if (kstrcmp(input, "IMAGES") == 0) {
+        image_print_stats();
+    }
+    else if (kstrcmp(input, "TICKLESS") == 0) {
+        if (arg && kstrcmp(arg, "ON") == 0) tickless_enabled = 1;
+        else if (arg && kstrcmp(arg, "OFF") == 0) tickless_enabled = 0;
+        tickless_print_stats();
+    }
+    else if (kstrcmp(input, "CPUS") == 0) {
+        smp_print_stats();
+    }
+    else if (kstrcmp(input, "SYSCALLS") == 0) {
+        syscall_print_stats();
     }
     else if (kstrcmp(input, "SLEEP") == 0) {
         if (arg) {
@@ -178,18 +224,17 @@ else if (kstrcmp(input, "SET_FPS") == 0) {
 else if (kstrcmp(input, "RUN") == 0) {
         if (arg) {
               struct fat_dir_entry* entry = fat_search(arg);
-                uint32_t size = entry->size;
-                char* file_data = fat_load_file(entry);
-                void* raw_code = kmalloc(size + 4096);
-                if (!raw_code) {
-                    kprintf_unsync("Memory allocation failed\n");
+              if (!entry) {
+                  kprintf_unsync("File '%s' not found.\n", arg);
+              } else {
+                // Cached images are shared: only the first RUN of a file reads the disk
+                int tid = image_spawn(entry, arg);
+                if (tid < 0) {
+                    kprintf_unsync("Could not start %s\n", arg);
                 } else {
-                    uint32_t aligned_code = ((uint32_t)raw_code + 0xFFF) & 0xFFFFF000;
-                    kmemcpy((void*)aligned_code, file_data, size);
-                    kfree(file_data); 
-                    int tid = spawn_task((void(*)())aligned_code, raw_code, arg);
-                    kprintf_unsync("Spawned %s (TID: %d, Entry: 0x%x)\n", arg, tid, aligned_code);
+                    kprintf_unsync("Spawned %s (TID: %d)\n", arg, tid);
                 }
+              }
         }
 }
 
@@ -321,32 +366,35 @@ else if (kstrcmp(input, "PWD") == 0) {
     }
 } 
     else if (kstrcmp(input, "PS") == 0) {
-        kprintf_unsync("TID   NAME         STATE\n");
-        for (int i = 0; i < MAX_TASKS; i++) {
+        kprintf_unsync("TID   NAME         STATE  STACK\n");
+        for (struct task* t = task_iter(NULL); t; t = task_iter(t)) {
+            int i = t->tid;
             if (task_is_ready(i)) {
                 char* name = task_get_name(i);
                 kprintf_unsync("%d     %s", i, name);
                 int len = kstrlen(name);
                 for (int j = 0; j < (12 - len); j++) kprintf_unsync(" ");
                 
-                if (task_get_state(i) == 1)      kprintf_unsync(" READY\n");
-                else if (task_get_state(i) == 2) kprintf_unsync(" SLEEP\n");
+                if (task_get_state(i) == 1)      kprintf_unsync(" READY");
+                else if (task_get_state(i) == 2) kprintf_unsync(" SLEEP");
+                kprintf_unsync("  %d KB\n", task_get_stack_pages(i) * 4);
             }
         }
+        task_print_stats();
     }
     else if (kstrcmp(input, "TOP") == 0) {
         run_top(); 
         VESA_clear(); // Clear back to shell after exiting TOP
     }
     else if (kstrcmp(input, "UPTIME") == 0) {
-        uint32_t current_ticks = system_ticks;
-        uint32_t current_freq = 100; // Assuming 100Hz
-        uint32_t s = current_ticks / current_freq;
-        kprintf_unsync("Uptime: %ds (Ticks: %d)\n", s, current_ticks);
+        uint64_t ns = clock_ns();
+        uint32_t ms = (uint32_t)div64_32(ns, NS_PER_MS);
+        kprintf_unsync("Uptime: %d.%ds (Ticks: %d)\n", ms / 1000, (ms % 1000) / 100, system_ticks);
+        clock_print_stats();
     }
     else if (kstrcmp(input, "KILL") == 0) {
         if (arg) {
-            int id = arg[0] - '0';
+            int id = katoi(arg); // tids go past 9 now
             if (id == 0) kprintf_unsync("Error: Cannot kill Shell\n");
             else {
                 kill_task(id);
@@ -354,6 +402,24 @@ else if (kstrcmp(input, "PWD") == 0) {
             }
         }
     }
+    else if (kstrcmp(input, "NICE") == 0) {
+        // NICE <tid> <level>: level 0 runs first, 3 only when nothing else wants to
+        char* level = 0;
+        if (arg) {
+            for (int i = 0; arg[i] != '\0'; i++) {
+                if (arg[i] == ' ') {
+                    arg[i] = '\0';
+                    level = &arg[i + 1];
+                    break;
+                }
+            }
+        }
+        if (level && sched_set_nice(katoi(arg), katoi(level)) == 0) {
+            kprintf_unsync("Task %d now at level %d\n", katoi(arg), katoi(level));
+        } else {
+            kprintf_unsync("Usage: NICE <tid> <0-%d>\n", SCHED_LEVELS - 1);
+        }
+    }
     else if (kstrcmp(input, "CLEAR") == 0) {
         VESA_clear_buffer_only(); 
         // No need to flip here, the final flip handles it
@@ -403,6 +469,12 @@ void shell_compile(const char* arg) {
     
     // 2. Allocate a buffer for the ACTUAL MACHINE CODE (binary)
     uint8_t* binary_buf = (uint8_t*)kmalloc(4096);
+    if (!source_buf || !binary_buf) {
+        kprintf_unsync("Error: could not load %s\n", arg);
+        if (source_buf) kfree(source_buf);
+        if (binary_buf) kfree(binary_buf);
+        return;
+    }
     uint32_t binary_size = 0; // This tracks ACTUAL BYTES generated
 
     char* line = source_buf;
@@ -0,0 +1,282 @@
+#include "simd.h"
+#include "cpu.h"
+#include "kheap.h"
+#include "lib.h"
+#include "task.h"
+#include "smp.h"
+
+int simd_available = 0;
+
+// What a task's FPU looks like before it first uses it (fninit + default MXCSR)
+static uint8_t fpu_initial_state[512] __attribute__((aligned(16)));
+static uint32_t fpu_traps = 0;
+static uint32_t fpu_saves = 0;
+
+/**
+ * Turns on SSE for the kernel: FPU emulation off, FXSAVE/FXRSTOR and
+ * SIMD exceptions on. Without FXSR + SSE2 everything stays on rep movs.
+ */
+void simd_init() {
+    if (!cpu_has(CPU_FEATURE_FXSR) || !cpu_has(CPU_FEATURE_SSE) || !cpu_has(CPU_FEATURE_SSE2)) return;
+
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    __asm__ volatile("fninit");
+    uint32_t mxcsr = 0x1F80; // All SIMD exceptions masked, round to nearest
+    __asm__ volatile("ldmxcsr %0" : : "m"(mxcsr));
+    __asm__ volatile("fxsave (%0)" : : "r"(fpu_initial_state) : "memory");
+    simd_available = 1;
+}
+
+/*
+ * Lazy task FPU state. After a switch CR0.TS is set, so the first FPU or
+ * SSE instruction a task runs traps to #NM (fpu_trap), which loads its
+ * state and makes it this CPU's fpu_owner. At the next switch the owner's
+ * registers are saved back to its TCB. A task that never touches the
+ * FPU never traps and is never saved.
+ *
+ * Saving at switch-out instead of when the next user traps costs an
+ * FXSAVE per FPU-using slice, but a task can migrate to another CPU
+ * without its registers being left behind on this one.
+ */
+
+// Called by schedule() when 'prev' is leaving this CPU, interrupts off
+void fpu_switch_out(struct task* prev) {
+    if (!simd_available) return;
+    struct cpu_local* cpu = this_cpu();
+    if (cpu->fpu_owner == prev) {
+        __asm__ volatile("clts"); // The fault task's iret may have set it again
+        __asm__ volatile("fxsave (%0)" : : "r"(prev->fpu_state) : "memory");
+        cpu->fpu_owner = NULL;
+        fpu_saves++;
+    }
+    // With no owner TS is usually still set from the last switch; writing
+    // CR0 serialises, so only do it when TS is actually clear
+    uint32_t cr0 = read_cr0();
+    if (!(cr0 & CR0_TS)) write_cr0(cr0 | CR0_TS);
+}
+
+/**
+ * #NM: a task used the FPU with TS set. Either its state is still live
+ * here (a hardware task switch set TS behind our back) or it needs
+ * loading: its own saved copy, or a clean one the first time.
+ */
+void fpu_trap() {
+    __asm__ volatile("clts");
+    struct cpu_local* cpu = this_cpu();
+    struct task* cur = cpu->current;
+    if (!simd_available || cpu->fpu_owner == cur) return;
+
+    uint8_t* state = cur->fpu_used ? cur->fpu_state : fpu_initial_state;
+    __asm__ volatile("fxrstor (%0)" : : "r"(state) : "memory");
+    cur->fpu_used = 1;
+    cpu->fpu_owner = cur;
+    fpu_traps++;
+}
+
+void fpu_print_stats() {
+    kprintf_unsync("Lazy FPU: %s, %d loads on #NM, %d saves on switch\n",
+        simd_available ? "on" : "off (no FXSR/SSE2)", fpu_traps, fpu_saves);
+}
+
+/**
+ * Brackets kernel SIMD use. Interrupts stay off in between, so no IRQ
+ * handler or task switch can see (or clobber) half-used XMM registers.
+ * If a task's state is live in the FPU it goes back to its TCB first and
+ * the task reloads it through #NM. TS can't tell us that: the page-fault
+ * task gate sets it under a live owner too.
+ */
+uint32_t kernel_fpu_begin() {
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    __asm__ volatile("clts");
+    struct cpu_local* cpu = this_cpu();
+    if (cpu->fpu_owner) {
+        __asm__ volatile("fxsave (%0)" : : "r"(cpu->fpu_owner->fpu_state) : "memory");
+        cpu->fpu_owner = NULL;
+        fpu_saves++;
+    }
+    return flags;
+}
+
+void kernel_fpu_end(uint32_t flags) {
+    write_cr0(read_cr0() | CR0_TS); // Nobody owns the FPU now; the next task use traps
+    __asm__ volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+/**
+ * The 64-byte SSE2 copy loop. Always copies forward and loads a whole
+ * block before storing it, so dest < src overlap (VESA_scroll) is safe.
+ * Must run between kernel_fpu_begin/end.
+ */
+static void sse2_copy(uint8_t* d, const uint8_t* s, uint32_t n, int nt) {
+    // 1. Byte head until the destination is 16-byte aligned
+    while (n && ((uint32_t)d & 15)) {
+        *d++ = *s++;
+        n--;
+    }
+
+    // 2. Bulk: unaligned loads, aligned (or streaming) stores
+    uint32_t blocks = n / 64;
+    n %= 64;
+    if (blocks && nt) {
+        __asm__ volatile(
+            "1:\n"
+            "prefetchnta 256(%1)\n"
+            "movdqu   0(%1), %%xmm0\n"
+            "movdqu  16(%1), %%xmm1\n"
+            "movdqu  32(%1), %%xmm2\n"
+            "movdqu  48(%1), %%xmm3\n"
+            "movntdq %%xmm0,  0(%0)\n"
+            "movntdq %%xmm1, 16(%0)\n"
+            "movntdq %%xmm2, 32(%0)\n"
+            "movntdq %%xmm3, 48(%0)\n"
+            "add $64, %1\n"
+            "add $64, %0\n"
+            "dec %2\n"
+            "jnz 1b\n"
+            "sfence\n" // Streaming stores are weakly ordered
+            : "+r"(d), "+r"(s), "+r"(blocks) : : "memory", "cc");
+    } else if (blocks) {
+        __asm__ volatile(
+            "1:\n"
+            "movdqu  0(%1), %%xmm0\n"
+            "movdqu 16(%1), %%xmm1\n"
+            "movdqu 32(%1), %%xmm2\n"
+            "movdqu 48(%1), %%xmm3\n"
+            "movdqa %%xmm0,  0(%0)\n"
+            "movdqa %%xmm1, 16(%0)\n"
+            "movdqa %%xmm2, 32(%0)\n"
+            "movdqa %%xmm3, 48(%0)\n"
+            "add $64, %1\n"
+            "add $64, %0\n"
+            "dec %2\n"
+            "jnz 1b\n"
+            : "+r"(d), "+r"(s), "+r"(blocks) : : "memory", "cc");
+    }
+
+    // 3. Tail
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static void sse2_fill32(uint32_t* d, uint32_t val, uint32_t count, int nt) {
+    // 1. Dword head until 16-byte aligned
+    while (count && ((uint32_t)d & 15)) {
+        *d++ = val;
+        count--;
+    }
+
+    // 2. Broadcast val into xmm0 and store 64 bytes per round
+    uint32_t blocks = count / 16;
+    count %= 16;
+    if (blocks) {
+        __asm__ volatile(
+            "movd %3, %%xmm0\n"
+            "pshufd $0, %%xmm0, %%xmm0\n"
+            "test %4, %4\n"
+            "jnz 2f\n"
+            "1:\n"
+            "movdqa %%xmm0,  0(%0)\n"
+            "movdqa %%xmm0, 16(%0)\n"
+            "movdqa %%xmm0, 32(%0)\n"
+            "movdqa %%xmm0, 48(%0)\n"
+            "add $64, %0\n"
+            "dec %1\n"
+            "jnz 1b\n"
+            "jmp 3f\n"
+            "2:\n"
+            "movntdq %%xmm0,  0(%0)\n"
+            "movntdq %%xmm0, 16(%0)\n"
+            "movntdq %%xmm0, 32(%0)\n"
+            "movntdq %%xmm0, 48(%0)\n"
+            "add $64, %0\n"
+            "dec %1\n"
+            "jnz 2b\n"
+            "sfence\n"
+            "3:\n"
+            : "+r"(d), "+r"(blocks) : "0"(d), "r"(val), "r"(nt) : "memory", "cc");
+    }
+
+    // 3. Tail
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(count) : "a"(val) : "memory");
+}
+
+void* simd_memcpy(void* dest, const void* src, uint32_t n) {
+    uint32_t flags = kernel_fpu_begin();
+    sse2_copy((uint8_t*)dest, (const uint8_t*)src, n, n >= SIMD_NT_BYTES);
+    kernel_fpu_end(flags);
+    return dest;
+}
+
+void* simd_memset32(void* dest, uint32_t val, uint32_t count) {
+    uint32_t flags = kernel_fpu_begin();
+    sse2_fill32((uint32_t*)dest, val, count, count * 4 >= SIMD_NT_BYTES);
+    kernel_fpu_end(flags);
+    return dest;
+}
+
+// --- MEMBENCH ---
+
+#define BENCH_BYTES  (1024 * 1024)
+#define BENCH_ROUNDS 4
+
+static void bench_report(const char* name, uint32_t cycles) {
+    // bytes/cycle with two decimals, all in 32-bit math
+    uint32_t hundredths = cycles ? (uint32_t)((BENCH_BYTES * BENCH_ROUNDS) / (cycles / 100 + 1)) : 0;
+    kprintf_unsync("  %s", name);
+    for (int i = kstrlen(name); i < 22; i++) kprintf_unsync(" ");
+    kprintf_unsync("%d.", hundredths / 100);
+    if (hundredths % 100 < 10) kprintf_unsync("0");
+    kprintf_unsync("%d bytes/cycle\n", hundredths % 100);
+}
+
+/**
+ * Copies and fills a 1MB buffer with every variant and reports throughput.
+ */
+void simd_benchmark() {
+    uint8_t* raw_src = (uint8_t*)kmalloc(BENCH_BYTES + 16);
+    uint8_t* raw_dst = (uint8_t*)kmalloc(BENCH_BYTES + 16);
+    if (!raw_src || !raw_dst) {
+        kprintf_unsync("MEMBENCH: out of memory\n");
+        if (raw_src) kfree(raw_src);
+        if (raw_dst) kfree(raw_dst);
+        return;
+    }
+    uint8_t* src = (uint8_t*)(((uint32_t)raw_src + 15) & ~15);
+    uint8_t* dst = (uint8_t*)(((uint32_t)raw_dst + 15) & ~15);
+
+    kprintf_unsync("MEMBENCH: %d KB x %d rounds (SSE2 %s)\n", BENCH_BYTES / 1024, BENCH_ROUNDS,
+        simd_available ? "on" : "off");
+
+    for (int variant = 0; variant < 6; variant++) {
+        if (variant >= 2 && variant != 4 && !simd_available) continue;
+
+        uint32_t cycles = 0;
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            uint8_t* d = dst;
+            const uint8_t* s = src;
+            uint32_t n = BENCH_BYTES;
+            uint32_t n32 = BENCH_BYTES / 4;
+            uint32_t flags;
+            uint64_t t0 = rdtsc();
+            switch (variant) {
+                case 0: __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory"); break;
+                case 1: __asm__ volatile("rep movsl" : "+D"(d), "+S"(s), "+c"(n32) : : "memory"); break;
+                case 2: flags = kernel_fpu_begin(); sse2_copy(d, s, n, 0); kernel_fpu_end(flags); break;
+                case 3: flags = kernel_fpu_begin(); sse2_copy(d, s, n, 1); kernel_fpu_end(flags); break;
+                case 4: __asm__ volatile("rep stosl" : "+D"(d), "+c"(n32) : "a"(0x222222) : "memory"); break;
+                case 5: flags = kernel_fpu_begin(); sse2_fill32((uint32_t*)d, 0x222222, n32, 0); kernel_fpu_end(flags); break;
+            }
+            cycles += (uint32_t)(rdtsc() - t0);
+        }
+
+        static const char* names[] = {
+            "memcpy rep movsb", "memcpy rep movsl", "memcpy SSE2",
+            "memcpy SSE2 NT", "memset rep stosl", "memset SSE2"
+        };
+        bench_report(names[variant], cycles);
+    }
+
+    kfree(raw_src);
+    kfree(raw_dst);
+}
@@ -0,0 +1,130 @@
+#include "slab.h"
+#include "kheap.h"
+#include "lib.h"
+#include <stddef.h>
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+static void list_push(struct slab** head, struct slab* s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+static void list_remove(struct slab** head, struct slab* s) {
+    if (s->prev) s->prev->next = s->next;
+    else *head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+// Where the first object of a slab starts: after the header and its back pointer
+static uint32_t first_object(struct slab_cache* c, struct slab* s) {
+    return ALIGN_UP((uint32_t)s + sizeof(struct slab) + sizeof(struct slab*), c->align);
+}
+
+/**
+ * 'align' must be a power of two; objects come back zeroed and aligned
+ * to it.
+ */
+void slab_cache_init(struct slab_cache* c, const char* name, uint32_t size, uint32_t align) {
+    if (align < sizeof(void*)) align = sizeof(void*);
+    c->name = name;
+    c->obj_size = ALIGN_UP(size, 4);
+    c->align = align;
+    c->slot_size = ALIGN_UP(c->obj_size + sizeof(struct slab*), align);
+    // Worst case the first object lands 'align' bytes past the header
+    c->per_slab = (SLAB_BYTES - sizeof(struct slab) - sizeof(struct slab*) - align) / c->slot_size;
+    c->partial = c->full = c->spare = NULL;
+    c->slabs = 0;
+    c->inuse = 0;
+    c->lock = SPINLOCK_INIT;
+}
+
+static struct slab* slab_grow(struct slab_cache* c) {
+    struct slab* s = (struct slab*)kheap_alloc(SLAB_BYTES, (uint32_t)__builtin_return_address(0));
+    if (!s) return NULL;
+    s->cache = c;
+    s->next = s->prev = NULL;
+    s->free = NULL;
+    s->inuse = 0;
+
+    // Thread the slots onto the free list back to front, so allocation goes upward
+    uint32_t obj = first_object(c, s) + (c->per_slab - 1) * c->slot_size;
+    for (uint32_t i = 0; i < c->per_slab; i++, obj -= c->slot_size) {
+        ((struct slab**)obj)[-1] = s;
+        *(void**)obj = s->free;
+        s->free = (void*)obj;
+    }
+    c->slabs++;
+    return s;
+}
+
+void* slab_alloc(struct slab_cache* c) {
+    uint32_t flags = spin_lock_irqsave(&c->lock);
+
+    struct slab* s = c->partial;
+    if (!s) {
+        if (c->spare) {
+            s = c->spare;
+            c->spare = NULL;
+        } else {
+            s = slab_grow(c);
+        }
+        if (!s) {
+            spin_unlock_irqrestore(&c->lock, flags);
+            return NULL;
+        }
+        list_push(&c->partial, s);
+    }
+
+    void* obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    c->inuse++;
+    if (!s->free) {
+        list_remove(&c->partial, s);
+        list_push(&c->full, s);
+    }
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    kmemset(obj, 0, c->obj_size / 4);
+    return obj;
+}
+
+void slab_free(void* obj) {
+    if (!obj) return;
+    struct slab* s = ((struct slab**)obj)[-1];
+    struct slab_cache* c = s->cache;
+    uint32_t flags = spin_lock_irqsave(&c->lock);
+
+    if (!s->free) {
+        list_remove(&c->full, s);
+        list_push(&c->partial, s);
+    }
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->inuse--;
+    c->inuse--;
+
+    // Last object gone: keep one empty slab, hand the rest back to the heap
+    struct slab* release = NULL;
+    if (s->inuse == 0) {
+        list_remove(&c->partial, s);
+        if (c->spare) {
+            release = s;
+            c->slabs--;
+        } else {
+            c->spare = s;
+        }
+    }
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    if (release) kheap_free(release);
+}
+
+void slab_print_stats(struct slab_cache* c) {
+    kprintf_unsync("Slab '%s': %d objects in use, %d slabs x %d (%d bytes each)\n",
+        c->name, c->inuse, c->slabs, c->per_slab, c->slot_size);
+}
@@ -0,0 +1,224 @@
+#include "smp.h"
+#include "apic.h"
+#include "gdt.h"
+#include "idt.h"
+#include "task.h"
+#include "sched.h"
+#include "kheap.h"
+#include "paging.h"
+#include "lib.h"
+#include "vesa.h"
+#include "tickless.h"
+#include "syscall.h"
+
+/*
+ * AP bring-up. The boot CPU copies the trampoline to AP_TRAMPOLINE, hands
+ * it CR0/CR3/CR4, a stack and ap_main, and wakes one AP at a time with
+ * INIT + SIPI. Each AP loads its own TSS and IDT, turns its local APIC
+ * on, and becomes an idle task; the scheduler feeds it from there.
+ */
+
+struct cpu_local cpus[MAX_CPUS];
+int cpu_count = 1;
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint32_t ap_tramp_cr0, ap_tramp_cr3, ap_tramp_cr4, ap_tramp_stack, ap_tramp_entry;
+extern volatile uint32_t system_ticks;
+
+static volatile int ap_booting = -1; // Slot of the AP being started, -1 once claimed
+static volatile int ap_started = 0;  // It made it to ap_main
+static uint64_t bsp_pat = 0;
+static struct mtrr_state bsp_mtrrs; // Only when VRAM is WC through an MTRR (no PAT)
+
+// TLB shootdown: one request at a time, each target clears its bit once flushed
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
+static volatile uint32_t shootdown_addr;
+static volatile uint32_t shootdown_pages;
+volatile uint32_t tlb_shootdown_mask = 0;
+static uint32_t shootdowns = 0;
+
+static void tramp_set(uint32_t* slot, uint32_t val) {
+    *(uint32_t*)(AP_TRAMPOLINE + ((uint8_t*)slot - ap_trampoline_start)) = val;
+}
+
+// Coarse delays off the PIT; at 100Hz that's 10-20ms for 'ticks' = 1
+static void wait_ticks(uint32_t ticks) {
+    uint32_t end = system_ticks + ticks + 1;
+    while ((int32_t)(system_ticks - end) < 0) __asm__ volatile("pause");
+}
+
+static void ap_main() {
+    // Claim the slot. -1 means the boot CPU gave up on us already: its
+    // stack and slot may belong to someone else by now, so stop right here.
+    int id = __sync_lock_test_and_set(&ap_booting, -1);
+    if (id < 0) {
+        while (1) __asm__ volatile("cli; hlt");
+    }
+    struct cpu_local* cpu = &cpus[id];
+
+    gdt_load_cpu(id);
+    idt_load_cpu(id);
+    syscall_init_cpu(id);
+    // Same memory types as the boot CPU, or the framebuffer would alias
+    if (paging_pat_enabled()) wrmsr(MSR_PAT, bsp_pat);
+    else mtrr_load(&bsp_mtrrs);
+    lapic_enable();
+    // From here shootdowns reach us; whatever changed before that is
+    // covered by dropping the whole TLB now
+    cpu->tlb_ipi = 1;
+    flush_tlb();
+
+    // What we're running on from here is this CPU's idle task
+    struct task* idle = task_adopt("idle", -1);
+    cpu->current = idle;
+    sched_init(idle->tid);
+
+    lapic_timer_start();
+    cpu->online = 1;
+    ap_started = 1;
+
+    __asm__ volatile("sti");
+    while (1) __asm__ volatile("hlt");
+}
+
+static int boot_ap(int id) {
+    uint8_t* stack = (uint8_t*)kmalloc(AP_STACK_SIZE);
+    if (!stack) return 0;
+
+    tramp_set(&ap_tramp_cr0, read_cr0() & ~CR0_TS);
+    tramp_set(&ap_tramp_cr3, read_cr3());
+    tramp_set(&ap_tramp_cr4, read_cr4());
+    tramp_set(&ap_tramp_stack, (uint32_t)stack + AP_STACK_SIZE);
+    tramp_set(&ap_tramp_entry, (uint32_t)ap_main);
+
+    ap_booting = id;
+    ap_started = 0;
+
+    // INIT, wait 10ms, then the startup IPI (twice, as the MP spec says)
+    uint32_t apic_id = cpus[id].apic_id;
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+    wait_ticks(1);
+    for (int i = 0; i < 2 && !ap_started; i++) {
+        lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        wait_ticks(1);
+    }
+    for (int i = 0; i < 100 && !ap_started; i++) wait_ticks(1);
+    if (ap_started) return 1;
+
+    // Too slow. If it already claimed the slot in ap_main it is on its way
+    // and only needs more time; otherwise take the slot back and park it
+    // with INIT so it can't turn up later on a stack or slot we reuse.
+    if (__sync_lock_test_and_set(&ap_booting, -1) < 0) {
+        while (!ap_started) __asm__ volatile("pause");
+        return 1;
+    }
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+    wait_ticks(1);
+    // The stack stays allocated: it may be running on it until INIT lands
+    return 0;
+}
+
+/**
+ * Runs on the boot CPU after interrupts are on. Without a usable MADT and
+ * IOAPIC we stay single-CPU on the PIC.
+ */
+void smp_init() {
+    cpus[0].online = 1;
+    cpus[0].tlb_ipi = 1;
+    int found = apic_init();
+    if (found <= 1 || !apic_active) return;
+
+    if (paging_pat_enabled()) bsp_pat = rdmsr(MSR_PAT);
+    else if (VESA_get_write_combining()) mtrr_save(&bsp_mtrrs);
+    uint32_t size = ap_trampoline_end - ap_trampoline_start;
+    kmemcpy((void*)AP_TRAMPOLINE, ap_trampoline_start, size);
+
+    // Slots stay packed: an AP that doesn't answer gives its slot to the next
+    int next = 1;
+    for (int i = 1; i < found; i++) {
+        cpus[next].apic_id = cpus[i].apic_id;
+        cpus[next].id = next;
+        cpu_count = next + 1; // Let the scheduler see the slot before the AP runs
+        if (boot_ap(next)) next++;
+    }
+    cpu_count = next;
+}
+
+// Flushes our part of the pending request (if any) and acks it
+void tlb_shootdown_poll() {
+    uint32_t bit = 1u << cpu_id();
+    if (!(tlb_shootdown_mask & bit)) return;
+    paging_flush_local(shootdown_addr, shootdown_pages);
+    __sync_fetch_and_and(&tlb_shootdown_mask, ~bit);
+}
+
+// TLB_SHOOTDOWN_VECTOR
+void tlb_shootdown_handler() {
+    tlb_shootdown_poll();
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/**
+ * Makes every other CPU drop its translations for 'pages' pages at
+ * virtual_addr, and waits until they have. The caller already changed
+ * the PTEs and flushed its own TLB; the frames may be freed on return.
+ */
+void smp_tlb_shootdown(uint32_t virtual_addr, uint32_t pages) {
+    if (cpu_count <= 1 || pages == 0) return;
+
+    // The xchg in the lock orders our PTE writes before the tlb_ipi reads
+    uint32_t flags = spin_lock_irqsave(&shootdown_lock);
+    int me = cpu_id();
+    uint32_t targets = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        if (i != me && cpus[i].tlb_ipi) targets |= 1u << i;
+    }
+    if (targets) {
+        shootdown_addr = virtual_addr;
+        shootdown_pages = pages;
+        tlb_shootdown_mask = targets;
+        for (int i = 0; i < cpu_count; i++) {
+            if (targets & (1u << i)) lapic_send_ipi(cpus[i].apic_id, TLB_SHOOTDOWN_VECTOR);
+        }
+        while (tlb_shootdown_mask) __asm__ volatile("pause" ::: "memory");
+        shootdowns++;
+    }
+    spin_unlock_irqrestore(&shootdown_lock, flags);
+}
+
+// TICKLESS_KICK_VECTOR, boot CPU only
+void tickless_kick_handler() {
+    tickless_kick();
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/**
+ * Only the boot CPU runs the wheel, and while it idles in a one-shot
+ * nothing else would look at a task an AP just woke for up to ~55ms.
+ */
+void smp_kick_boot_cpu() {
+    if (cpu_id() == 0 || !tickless_active()) return;
+    lapic_send_ipi(cpus[0].apic_id, TICKLESS_KICK_VECTOR);
+}
+
+/**
+ * Every CPU but this one is in its idle task. Tasks running on APs add
+ * timers against the boot CPU's wheel, so it only stops ticking then.
+ */
+int smp_others_idle() {
+    int me = cpu_id();
+    for (int i = 0; i < cpu_count; i++) {
+        if (i != me && cpus[i].online && cpus[i].current != cpus[i].idle) return 0;
+    }
+    return 1;
+}
+
+void smp_print_stats() {
+    kprintf_unsync("CPUs online: %d (%s), %d TLB shootdowns\n", cpu_count,
+        apic_active ? "APIC" : "PIC", shootdowns);
+    for (int i = 0; i < cpu_count; i++) {
+        kprintf_unsync("  CPU %d: APIC %d, %d ticks, %d stolen\n",
+            i, cpus[i].apic_id, cpus[i].ticks, cpus[i].steals);
+    }
+}
@@ -0,0 +1,190 @@
+#include "syscall.h"
+#include "idt.h"
+#include "cpu.h"
+#include "task.h"
+#include "vesa.h"
+#include "lib.h"
+#include "clock.h"
+
+/*
+ * One table for both ways in: int 0x80 (isr128_stub, full register frame)
+ * and SYSENTER (sysenter_entry, just the six argument registers).
+ * Everything runs in ring 0, so SYSEXIT (which always lands in ring 3) is
+ * no use to us: sysenter_entry goes back to the caller's stack and rets
+ * to the address its call pushed. Sleep and exit get off the CPU through
+ * yield() from inside the handler, so neither path switches stacks itself.
+ */
+
+int sysenter_available = 0;
+static uint8_t sysenter_stack[MAX_CPUS][1024] __attribute__((aligned(16)));
+static uint32_t calls_fast = 0;
+static uint32_t calls_int = 0;
+
+extern volatile uint32_t system_ticks;
+extern void sysenter_entry();
+
+// Grows the task's bounding box so exit/KILL can wipe what it drew
+static void track_drawing(int x, int y, int w, int h) {
+    struct task* t = current_task;
+    if (x < t->first_x) t->first_x = x;
+    if (y < t->first_y) t->first_y = y;
+    if (x + w > t->last_x) t->last_x = x + w;
+    if (y + h > t->last_y) t->last_y = y + h;
+    t->has_drawn = 1;
+}
+
+static void sys_draw_char(struct syscall_args* a) {
+    int x = a->ecx;
+    int y = a->edx;
+    track_drawing(x, y, 8, 8); // 8x8 font
+    VESA_draw_char((char)a->ebx, x, y, 0xFFFFFF);
+}
+
+static void sys_get_ticks(struct syscall_args* a) {
+    a->eax = system_ticks;
+}
+
+static void sys_sleep(struct syscall_args* a) {
+    sleep(a->ebx); // SLEEPING on the timer wheel, back here once it's over
+}
+
+static void sys_exit(struct syscall_args* a) {
+    (void)a;
+    struct task* t = current_task;
+    kprintf_unsync("Task %d exited.\n", t->tid);
+    task_make_zombie(t); // Dead, but we are still on its stack
+    if (t->has_drawn) {
+        int w = t->last_x - t->first_x;
+        int h = t->last_y - t->first_y;
+
+        // Safety check to prevent massive unsigned underflow clears
+        if (w > 0 && w < 2000 && h > 0 && h < 2000) {
+            VESA_clear_region(t->first_x, t->first_y, w, h);
+            VESA_flip();
+        }
+    }
+    // The stack goes later: spawn_task/kill_task reap zombies once we're off it
+    task_release_code(t->tid);
+    yield(); // Zombies are never picked again, so this doesn't come back
+}
+
+static void sys_clear(struct syscall_args* a) {
+    (void)a;
+    VESA_clear();
+    // The screen is empty, so is the task's bounding box
+    struct task* t = current_task;
+    t->first_x = 0;
+    t->first_y = 0;
+    t->last_x = 0;
+    t->last_y = 0;
+    t->has_drawn = 0;
+}
+
+// EBX x, ECX y, EDX w, ESI h, EDI color
+static void sys_draw_rect(struct syscall_args* a) {
+    track_drawing(a->ebx, a->ecx, a->edx, a->esi);
+    VESA_draw_rect(a->ebx, a->ecx, a->edx, a->esi, a->edi);
+}
+
+static void sys_time_ns(struct syscall_args* a) {
+    uint64_t ns = clock_ns();
+    a->eax = (uint32_t)ns;
+    a->edx = (uint32_t)(ns >> 32);
+}
+
+static void (*const syscall_table[SYSCALL_COUNT])(struct syscall_args*) = {
+    [SYS_DRAW_CHAR] = sys_draw_char,
+    [SYS_GET_TICKS] = sys_get_ticks,
+    [SYS_SLEEP]     = sys_sleep,
+    [SYS_EXIT]      = sys_exit,
+    [SYS_CLEAR]     = sys_clear,
+    [SYS_DRAW_RECT] = sys_draw_rect,
+    [SYS_TIME_NS]   = sys_time_ns,
+};
+
+static void dispatch(struct syscall_args* a) {
+    if (a->eax < SYSCALL_COUNT && syscall_table[a->eax]) syscall_table[a->eax](a);
+}
+
+// From sysenter_entry, interrupts off
+void syscall_dispatch(struct syscall_args* args) {
+    calls_fast++;
+    dispatch(args);
+}
+
+// int 0x80: same table, results copied back into the frame popa restores
+void syscall_handler(struct registers* regs) {
+    calls_int++;
+    struct syscall_args a = { regs->eax, regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi };
+    dispatch(&a);
+    regs->eax = a.eax;
+    regs->edx = a.edx;
+}
+
+/**
+ * Points this CPU's SYSENTER MSRs at sysenter_entry. The stack it starts
+ * on is only there until the stub moves back to the caller's.
+ * Family 6 model < 3 stepping < 3 (early Pentium Pro) sets SEP without
+ * having SYSENTER.
+ */
+void syscall_init_cpu(int cpu) {
+    if (cpu == 0) {
+        uint32_t family = (cpu_signature >> 8) & 0xF;
+        uint32_t model = (cpu_signature >> 4) & 0xF;
+        uint32_t stepping = cpu_signature & 0xF;
+        sysenter_available = cpu_has(CPU_FEATURE_SEP) && cpu_has(CPU_FEATURE_MSR) &&
+            !(family == 6 && model < 3 && stepping < 3);
+    }
+    if (!sysenter_available) return;
+
+    wrmsr(MSR_SYSENTER_CS, 0x08); // SS comes out as CS + 8 = 0x10
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)sysenter_stack[cpu] + sizeof(sysenter_stack[cpu]));
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+// For COMPILE: the fastest way in this CPU supports
+void emit_syscall(uint8_t* out_buf, uint32_t* pos) {
+    static const uint8_t fast[] = SYSENTER_CALL_BYTES;
+    if (sysenter_available) {
+        for (uint32_t i = 0; i < sizeof(fast); i++) out_buf[(*pos)++] = fast[i];
+    } else {
+        out_buf[(*pos)++] = 0xCD; // INT 0x80
+        out_buf[(*pos)++] = 0x80;
+    }
+}
+
+// GET_TICKS both ways, best of a few rounds, in cycles per call
+void syscall_print_stats() {
+    kprintf_unsync("Syscalls: %d via SYSENTER, %d via int 0x80\n", calls_fast, calls_int);
+    if (!cpu_has(CPU_FEATURE_TSC)) return;
+
+    uint32_t best_int = 0xFFFFFFFF, best_fast = 0xFFFFFFFF;
+    for (int round = 0; round < 4; round++) {
+        uint64_t t0 = rdtsc();
+        for (int i = 0; i < 256; i++) {
+            uint32_t nr = SYS_GET_TICKS;
+            __asm__ volatile("int $0x80" : "+a"(nr) : : "edx", "memory", "cc");
+        }
+        uint32_t c = (uint32_t)(rdtsc() - t0) / 256;
+        if (c < best_int) best_int = c;
+
+        if (!sysenter_available) continue;
+        t0 = rdtsc();
+        for (int i = 0; i < 256; i++) {
+            uint32_t nr = SYS_GET_TICKS;
+            __asm__ volatile(
+                "call 1f\n"
+                "jmp 2f\n"
+                "1: push %%ebp\n"
+                "mov %%esp, %%ebp\n"
+                "sysenter\n"
+                "2:\n"
+                : "+a"(nr) : : "edx", "memory", "cc");
+        }
+        c = (uint32_t)(rdtsc() - t0) / 256;
+        if (c < best_fast) best_fast = c;
+    }
+    kprintf_unsync("  int 0x80 : %d cycles/call\n", best_int);
+    if (sysenter_available) kprintf_unsync("  SYSENTER : %d cycles/call\n", best_fast);
+    else kprintf_unsync("  SYSENTER : not supported\n");
+}
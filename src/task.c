@@ -5,17 +5,32 @@
 #include "io.h"
 #include "shell.h"
 #include "lib.h"
+#include "gdt.h"
+#include "pmm.h"
+#include "paging.h"
+#include "image.h"
+#include "sched.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "clock.h"
 
-#define MAX_TASKS 10
 int keyboard_focus_tid = 0; // Default focus is the Shell (Task 0)
 extern int vesa_updating;
 // External assembly function
 extern void switch_to_stack(uint32_t* old_esp, uint32_t new_esp);
 extern volatile uint32_t system_ticks;
 int multitasking_enabled = 0;
-// The Task Control Block (TCB) array
-volatile struct task task_list[MAX_TASKS];
-int current_task_idx = 0;
+// Task Control Blocks come out of a slab; tids index a hash, not an array
+static struct slab_cache task_cache;
+static uint32_t pid_bitmap[TASK_PID_MAX / 32]; // Bit set = tid taken
+static int last_pid = 0;                        // Handed out cyclically from here
+static struct task* task_hash[TASK_HASH_SIZE];
+static struct task* task_all = NULL;            // Live list head
+static struct task* task_all_tail = NULL;
+static uint32_t nr_tasks = 0;
+static uint32_t nr_zombies = 0;
+static spinlock_t task_lock = SPINLOCK_INIT;
+
 void shell_task() {
     char line[128];
     int idx = 0;
@@ -24,7 +39,7 @@ void shell_task() {
     VESA_print("> ", COLOR_YELLOW);
 
     while(1) {
-        char c = keyboard_getchar(); // This must call yield() internally if no key
+        char c = keyboard_getchar(); // Sleeps on the keyboard wait queue until a key arrives
 
         if (c == '\n') {
             line[idx] = '\0';
@@ -52,108 +67,330 @@ void shell_task() {
     }
 }
 
-int spawn_task(void (*entry_point)(), void* code_ptr, char* name) {
-    for (int i = 1; i < MAX_TASKS; i++) {
-        if (task_list[i].state == 0) {
-            // 1. Reset Metadata & Set Name
-            task_list[i].has_drawn = 0;
-            task_list[i].last_x = 0;
-            task_list[i].last_y = 0;
-
-            // Initialize CPU Accounting and Sleep state ---
-            task_list[i].total_ticks = 0;    // Reset CPU odometer
-            task_list[i].sleep_ticks = 0;    // Ensure it doesn't start asleep
-      
-            // Copy name safely
-            kstrncpy((char*)task_list[i].name, name, 15);
-            task_list[i].name[15] = '\0'; 
-
-            // 2. Allocate RAW memory (Store this for kfree)
-            // We allocate 8KB to ensure we can find a 4KB aligned block inside
-            void* raw_stack = kmalloc(4096 + 0x1000);
-            if (!raw_stack) return -1;
-
-            task_list[i].stack_ptr = raw_stack; 
-            task_list[i].code_ptr = code_ptr; 
-
-            // 3. Calculate the ALIGNED stack for the CPU
-            uint32_t aligned_stack = (uint32_t)raw_stack;
-            if (aligned_stack & 0xFFF) {
-                aligned_stack &= 0xFFFFF000;
-                aligned_stack += 0x1000;
-            }
+// --- Task table ---
+
+// Next free tid after the last one handed out; tid 0 is the shell's
+static int pid_alloc() {
+    for (int n = 1; n < TASK_PID_MAX; n++) {
+        int pid = (last_pid + n) & (TASK_PID_MAX - 1);
+        if (pid == 0) continue;
+        // Skip whole words that are full
+        if (pid_bitmap[pid / 32] == 0xFFFFFFFF) {
+            n += 31 - (pid & 31);
+            continue;
+        }
+        if (!(pid_bitmap[pid / 32] & (1u << (pid & 31)))) {
+            pid_bitmap[pid / 32] |= 1u << (pid & 31);
+            last_pid = pid;
+            return pid;
+        }
+    }
+    return -1;
+}
+
+static void pid_free(int pid) {
+    pid_bitmap[pid / 32] &= ~(1u << (pid & 31));
+}
+
+/*
+ * Any CPU may reap a TCB, so a pointer from task_find is only good for
+ * as long as something else keeps the task alive (it is current, on a
+ * wait queue we hold, ...). Everyone else pins it: a pinned task stays
+ * in the table and in memory until it is unpinned. task_lock is a leaf,
+ * nothing else is ever taken while holding it.
+ */
+static struct task* hash_lookup(int id) {
+    struct task* t = task_hash[id & (TASK_HASH_SIZE - 1)];
+    while (t && t->tid != id) t = t->hash_next;
+    return t;
+}
 
-            // 4. Build the stack frame at the TOP of the aligned 4KB
-            uint32_t* s_ptr = (uint32_t*)(aligned_stack + 4096);
+struct task* task_find(int id) {
+    if (id < 0 || id >= TASK_PID_MAX) return NULL;
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    struct task* t = hash_lookup(id);
+    spin_unlock_irqrestore(&task_lock, flags);
+    return t;
+}
 
-            // --- THE IRET FRAME ---
-            *--s_ptr = 0x10;                     // SS
-            uint32_t task_stack_top = (uint32_t)s_ptr; 
-            *--s_ptr = task_stack_top;           // ESP
-            *--s_ptr = 0x202;                    // EFLAGS
-            *--s_ptr = 0x08;                     // CS
-            *--s_ptr = (uint32_t)entry_point;    // EIP
+// task_find that keeps the task around until task_unpin. NULL if it's gone.
+struct task* task_pin(int id) {
+    if (id < 0 || id >= TASK_PID_MAX) return NULL;
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    struct task* t = hash_lookup(id);
+    if (t && t->state != TASK_EMPTY) t->pins++;
+    else t = NULL;
+    spin_unlock_irqrestore(&task_lock, flags);
+    return t;
+}
 
-            // --- INT DATA (Matches irq0_handler) ---
-            *--s_ptr = 0;                        // err_code
-            *--s_ptr = 32;                       // int_no (Timer)
+void task_unpin(struct task* t) {
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    t->pins--;
+    spin_unlock_irqrestore(&task_lock, flags);
+}
 
-            // --- PUSHA FRAME ---
-            for(int j = 0; j < 8; j++) *--s_ptr = 0;
+// Hash + live list; interrupts off so the fault task and scheduler see it whole
+static void task_link(struct task* t) {
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    struct task** bucket = &task_hash[t->tid & (TASK_HASH_SIZE - 1)];
+    t->hash_next = *bucket;
+    *bucket = t;
+
+    t->all_next = NULL;
+    t->all_prev = task_all_tail;
+    if (task_all_tail) task_all_tail->all_next = t;
+    else task_all = t;
+    task_all_tail = t;
+    nr_tasks++;
+    spin_unlock_irqrestore(&task_lock, flags);
+}
 
-            // --- DATA SEGMENT ---
-            *--s_ptr = 0x10;                     // DS
+static void task_unlink(struct task* t) {
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    struct task** link = &task_hash[t->tid & (TASK_HASH_SIZE - 1)];
+    while (*link && *link != t) link = &(*link)->hash_next;
+    if (*link) *link = t->hash_next;
+
+    if (t->all_prev) t->all_prev->all_next = t->all_next;
+    else task_all = t->all_next;
+    if (t->all_next) t->all_next->all_prev = t->all_prev;
+    else task_all_tail = t->all_prev;
+    nr_tasks--;
+    pid_free(t->tid);
+    spin_unlock_irqrestore(&task_lock, flags);
+}
 
-            // 5. Save final ESP and set to READY
-            task_list[i].esp = (uint32_t)s_ptr;
-            task_list[i].state = 1; 
-            
-            return i;
-        }
+/**
+ * Walks the live tasks, each one pinned while the caller has it:
+ *     for (t = task_iter(NULL); t; t = task_iter(t)) ...
+ * Unpins 'prev' and pins the next. Leaving the loop early means
+ * task_unpin on the last one.
+ */
+struct task* task_iter(struct task* prev) {
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    struct task* t = prev ? prev->all_next : task_all; // Pinned, so still linked
+    while (t && t->state == TASK_EMPTY) t = t->all_next;
+    if (t) t->pins++;
+    if (prev) prev->pins--;
+    spin_unlock_irqrestore(&task_lock, flags);
+    return t;
+}
+
+// --- Stacks ---
+
+static uint32_t stack_slot_base(int id) {
+    return TASK_STACK_REGION + (uint32_t)id * TASK_STACK_SLOT;
+}
+
+uint32_t task_stack_top(int id) {
+    return stack_slot_base(id) + TASK_STACK_SLOT;
+}
+
+// Backs one stack page with a zeroed frame. Returns 0 if the PMM is dry.
+static int stack_commit(struct task* t, uint32_t page) {
+    if (paging_get_entry(page) & PAGE_PRESENT) return 1;
+    void* frame = pmm_alloc_page();
+    if (!frame) return 0;
+    if (map_page(page, (uint32_t)frame) != 0) {
+        pmm_free_page(frame);
+        return 0;
     }
-    return -1;
+    // Plain stosl: we may be in the fault task, in the middle of someone's kernel_fpu section
+    uint32_t* d = (uint32_t*)page;
+    uint32_t n = 1024;
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(n) : "a"(0) : "memory");
+    t->stack_pages++;
+    return 1;
 }
 
-// Stacks for the tasks (10 stacks of 4KB each)
-uint32_t task_stacks[MAX_TASKS][1024];
+// Gives every committed page of the slot back to the PMM
+void task_stack_release(int id) {
+    struct task* t = task_find(id);
+    if (!t) return;
+    for (uint32_t page = stack_slot_base(id) + TASK_STACK_GUARD; page < task_stack_top(id); page += 4096) {
+        uint32_t phys = paging_get_phys(page);
+        if (!phys) continue;
+        unmap_page(page);
+        pmm_free_page((void*)(phys & ~0xFFF));
+    }
+    t->stack_pages = 0;
+}
+
+/**
+ * An exited task can't free the stack it is running on; whoever comes
+ * next does it. Each zombie is claimed under task_lock by making it
+ * EMPTY, which no pin can get hold of, so two reapers never collide.
+ */
+static void reap_zombies() {
+    while (nr_zombies) {
+        uint32_t flags = spin_lock_irqsave(&task_lock);
+        struct task* t = task_all;
+        while (t && (t->state != TASK_ZOMBIE || t->on_cpu || t->pins)) t = t->all_next;
+        if (t) t->state = TASK_EMPTY;
+        spin_unlock_irqrestore(&task_lock, flags);
+        if (!t) return;
+
+        __sync_fetch_and_sub(&nr_zombies, 1);
+        // Exit releases the code itself, but a tick may beat it to yield()
+        task_release_code(t->tid);
+        task_stack_release(t->tid);
+        task_unlink(t);
+        slab_free(t);
+    }
+}
+
+// Exit syscall: the TCB stays until someone reaps it off-stack
+void task_make_zombie(struct task* t) {
+    t->state = TASK_ZOMBIE;
+    __sync_fetch_and_add(&nr_zombies, 1);
+}
+
+// Where a task that blew its stack goes to die
+static void stack_overflow_exit() {
+    __asm__ volatile("int $0x80" : : "a"(4));
+    while (1) __asm__ volatile("hlt");
+}
+
+/**
+ * Called from the page-fault task with the faulting address. Returns 0 if
+ * the address is not in a live stack slot, 1 if the task may retry.
+ * A task that hits its guard page is sent to the exit syscall instead.
+ */
+int task_stack_fault(uint32_t addr) {
+    if (addr < TASK_STACK_REGION || addr >= TASK_STACK_REGION + TASK_PID_MAX * TASK_STACK_SLOT) return 0;
+    int id = (addr - TASK_STACK_REGION) / TASK_STACK_SLOT;
+    // Nearly always our own stack. Don't take task_lock for that: the
+    // faulting code may be the one holding it.
+    struct task* t = current_task;
+    if (!t || t->tid != id) t = task_find(id);
+    if (!t || t->state == TASK_EMPTY) return 0;
+
+    uint32_t page = addr & ~0xFFF;
+    uint32_t lowest = stack_slot_base(id) + TASK_STACK_GUARD;
+    if (page >= lowest && stack_commit(t, page)) {
+        // Keep one page of slack below, so an IRQ frame pushed right at the
+        // edge lands in mapped memory instead of faulting mid-delivery
+        if (page - 4096 >= lowest) stack_commit(t, page - 4096);
+        return 1;
+    }
+
+    // Guard page (or out of frames): restart the task in stack_overflow_exit
+    // on the top of its own stack, which is always committed
+    if (t != current_task) return 0;
+    kprintf_unsync("Task %d (%s): stack overflow at 0x%x, EIP 0x%x\n",
+        id, t->name, addr, kernel_tss.eip);
+    kernel_tss.eip = (uint32_t)stack_overflow_exit;
+    kernel_tss.esp = task_stack_top(id) - 16;
+    kernel_tss.ebp = 0;
+    kernel_tss.eflags = 0x202;
+    return 1;
+}
+
+int spawn_task(void (*entry_point)(), void* code_ptr, char* name) {
+    reap_zombies();
+
+    // 1. A zeroed TCB and a tid (which is also the stack slot)
+    struct task* t = (struct task*)slab_alloc(&task_cache);
+    if (!t) return -1;
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    int i = pid_alloc();
+    spin_unlock_irqrestore(&task_lock, flags);
+    if (i < 0) {
+        slab_free(t);
+        return -1;
+    }
+    t->tid = i;
+
+    // Copy name safely
+    kstrncpy(t->name, name, 15);
+    t->name[15] = '\0'; 
 
-// Correct yield loop logic
+    // 2. Commit just the top page of the slot; the rest comes on demand
+    if (!stack_commit(t, task_stack_top(i) - 4096)) {
+        pid_free(i);
+        slab_free(t);
+        return -1;
+    }
+
+    t->code_ptr = code_ptr; 
+
+    // 3. Build the stack frame at the TOP of the slot
+    uint32_t* s_ptr = (uint32_t*)task_stack_top(i);
+
+    // --- THE IRET FRAME ---
+    *--s_ptr = 0x10;                     // SS
+    uint32_t task_stack_top = (uint32_t)s_ptr; 
+    *--s_ptr = task_stack_top;           // ESP
+    *--s_ptr = 0x202;                    // EFLAGS
+    *--s_ptr = 0x08;                     // CS
+    *--s_ptr = (uint32_t)entry_point;    // EIP
+
+    // --- INT DATA (Matches irq0_handler) ---
+    *--s_ptr = 0;                        // err_code
+    *--s_ptr = 32;                       // int_no (Timer)
+
+    // --- PUSHA FRAME ---
+    for(int j = 0; j < 8; j++) *--s_ptr = 0;
+
+    // --- DATA SEGMENT ---
+    *--s_ptr = 0x10;                     // DS
+
+    // 4. Save final ESP, publish and set to READY
+    t->esp = (uint32_t)s_ptr;
+    t->priority = SCHED_DEFAULT_PRIORITY;
+    t->base_priority = SCHED_DEFAULT_PRIORITY;
+    t->cpu = cpu_id();
+    t->state = TASK_READY; 
+    task_link(t);
+    sched_enqueue(i);
+
+    return i;
+}
+
+// Gives up the rest of the slice. Straight to schedule(): no tick, no EOI
 void yield() {
-    __asm__ volatile("int $0x20"); // Trigger the Timer Interrupt manually
+    if (current_task) current_task->yielding = 1; // Go behind the others at our level
+    __asm__ volatile("int $0x81");
 }
 
 void kill_task(int id) {
-    if (id <= 0 || id >= MAX_TASKS) return;
+    if (id <= 0 || sched_is_idle(id)) return;
+    struct task* t = task_pin(id);
+    if (!t) return;
 
-    if (task_list[id].has_drawn) {
-        int w = task_list[id].last_x - task_list[id].first_x;
-        int h = task_list[id].last_y - task_list[id].first_y;
+    if (t->has_drawn) {
+        int w = t->last_x - t->first_x;
+        int h = t->last_y - t->first_y;
         
         // Safety check to prevent massive unsigned underflow clears
         if (w > 0 && w < 2000 && h > 0 && h < 2000) {
-            VESA_clear_region(task_list[id].first_x, task_list[id].first_y, w, h);
+            VESA_clear_region(t->first_x, t->first_y, w, h);
             VESA_flip(); 
         }
     }
 
-    // Mark as dead immediately to stop the scheduler from picking it
-    task_list[id].state = 0;
-
-    if (task_list[id].stack_ptr) {
-        kfree(task_list[id].stack_ptr);
-        task_list[id].stack_ptr = NULL;
-    }
-    if (task_list[id].code_ptr) {
-        kfree(task_list[id].code_ptr);
-        task_list[id].code_ptr = NULL;
-    }
+    // Stop the scheduler from picking it; sched_enqueue ignores it from here on
+    t->kill_pending = 1;
+    sched_dequeue(id);
+    timer_cancel(&t->sleep_timer);
+    wait_remove(t);
+    // Running somewhere (maybe here): schedule() turns it into a zombie as
+    // it switches away. Otherwise it is one now. Either way the reaper
+    // frees it, once nobody else has it pinned.
+    if (!t->on_cpu && t->state != TASK_ZOMBIE) task_make_zombie(t);
+    task_unpin(t);
+    reap_zombies();
+}
 
-    // Reset everything for the next spawn
-    task_list[id].has_drawn = 0;
-    task_list[id].first_x = 0;
-    task_list[id].first_y = 0;
-    task_list[id].last_x = 0;
-    task_list[id].last_y = 0;
+// Code lives in a kmalloc buffer (RUN_TEST) or a mapped program image (RUN)
+void task_release_code(int id) {
+    struct task* t = task_find(id);
+    if (!t || !t->code_ptr) return;
+    uint32_t code = (uint32_t)t->code_ptr;
+    if (code >= IMAGE_REGION && code < IMAGE_REGION_END) image_unmap(code);
+    else kfree((void*)code);
+    t->code_ptr = NULL;
 }
 
 void idle_task_code() {
@@ -161,74 +398,116 @@ void idle_task_code() {
         __asm__ volatile("hlt");
     }
 }
-void init_multitasking() {
-    multitasking_enabled = 1;
-    for (int i = 0; i < MAX_TASKS; i++){
-      task_list[i].state = 0;
-      task_list[i].first_x = 0; // Default to 0 for the shell
-      task_list[i].first_y = 0;
-      task_list[i].last_x = 0;
-      task_list[i].last_y = 0;
+/**
+ * Gives whatever is running on this CPU right now a TCB, so the scheduler
+ * can switch away from it. Its stack is wherever it already is.
+ * 'tid' < 0 takes the next free one.
+ */
+struct task* task_adopt(char* name, int tid) {
+    struct task* t = (struct task*)slab_alloc(&task_cache);
+    if (!t) return NULL;
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    if (tid < 0) tid = pid_alloc();
+    else pid_bitmap[tid / 32] |= 1u << (tid & 31);
+    spin_unlock_irqrestore(&task_lock, flags);
+    if (tid < 0) {
+        slab_free(t);
+        return NULL;
     }
-    // Task 0: Shell
-    task_list[0].state = 1;
-    kstrncpy((char* )task_list[0].name, "shell", 15);
+    t->tid = tid;
+    kstrncpy(t->name, name, 15);
+    t->state = TASK_READY;
+    t->cpu = cpu_id();
+    t->on_cpu = 1;
+    t->exec_start = clock_ns();
+    task_link(t);
+    this_cpu()->current = t;
+    return t;
+}
+
+void init_multitasking() {
+    slab_cache_init(&task_cache, "task", sizeof(struct task), 16);
+
+    // Task 0: Shell, already running on the boot stack
+    struct task* shell = task_adopt("shell", 0);
+    shell->priority = 0; // Typing should never wait behind background work
     
-    // Task 9: Idle Task (Always READY)
-    // Use your existing spawn_task logic or manually set it up
-    spawn_task(idle_task_code, NULL, "idle");
+    // Idle Task (Always READY)
+    int idle = spawn_task(idle_task_code, NULL, "idle");
     
-    current_task_idx = 0;
+    sched_init(idle); // The idle task lives outside the ready queues
+    multitasking_enabled = 1;
 }
 // Helper function
 int get_current_task_id() {
-    return current_task_idx;
+    struct task* t = current_task;
+    return t ? t->tid : 0;
 }
 
 int task_is_ready(int id) {
-    if (id < 0 || id >= MAX_TASKS) return 0;
-    return task_list[id].state == 1;
+    struct task* t = task_find(id);
+    return t && t->state == TASK_READY;
 }
 
 uint32_t task_get_esp(int id) {
-    if (id < 0 || id >= MAX_TASKS) return 0;
-    return task_list[id].esp;
+    struct task* t = task_find(id);
+    return t ? t->esp : 0;
 }
 
 char* task_get_name(int id) {
-    if (id < 0 || id >= MAX_TASKS) return "unused";
-    return (char*)task_list[id].name;
+    struct task* t = task_find(id);
+    return t ? t->name : "unused";
 }
 
 int task_get_state(int id){
-    if (id < 0 || id >= MAX_TASKS) return -1;
-    return task_list[id].state;
+    struct task* t = task_find(id);
+    return t ? (int)t->state : -1;
 }
 int task_get_sleep_ticks(int id){
-  if (id < 0 || id >= MAX_TASKS) return -1;
-  return task_list[id].sleep_ticks;
+  struct task* t = task_find(id);
+  return t ? (int)timer_remaining(&t->sleep_timer) : -1;
 }
+
 int task_get_total_ticks(int id){
-  if (id < 0 || id >= MAX_TASKS) return -1;
-  return task_list[id].total_ticks;
+  struct task* t = task_find(id);
+  return t ? (int)t->total_ticks : -1;
+}
+int task_get_priority(int id){
+  struct task* t = task_find(id);
+  return t ? (int)t->priority : -1;
+}
+int task_get_stack_pages(int id){
+  struct task* t = task_find(id);
+  return t ? (int)t->stack_pages : -1;
+}
+int task_count() {
+    return nr_tasks;
+}
+void task_print_stats() {
+    kprintf_unsync("Tasks: %d live, %d zombies, tid limit %d\n", nr_tasks, nr_zombies, TASK_PID_MAX);
+    slab_print_stats(&task_cache);
 }
 void task_timer() {
-    uint32_t seconds = 0;
+    uint64_t start = clock_ns();
     while (1) {
+        // Off the clock rather than counting sleeps, so it doesn't drift
+        uint64_t elapsed = clock_ns() - start;
+        uint32_t seconds = (uint32_t)div64_32(elapsed, NS_PER_SEC);
+        uint32_t into = (uint32_t)(elapsed - (uint64_t)seconds * NS_PER_SEC);
         seconds++;
 
         char buf[20];
-        kmemset(buf, 0, 20);
+        kmemset(buf, 0, 20 / 4);
         kstrcpy(buf, "TIMER: ");
         itoa(seconds, buf + 7, 10); 
         VESA_print_at(buf, 900, 10, 0x00FFFF); 
 
-        sleep(1000); 
+        sleep((NS_PER_SEC - into) / NS_PER_MS + 1); // Just past the next full second
     }
 }
 void task_game() {
     int previous_focus = keyboard_focus_tid;
-    keyboard_focus_tid = current_task_idx;
+    keyboard_set_focus(current_task_idx);
     
   // 1. Preparation
     while (has_key_in_buffer()) { get_key_from_buffer(); }
@@ -246,60 +525,63 @@ void task_game() {
     VESA_flip();
 
     while (exit == 0) {
-        if (has_key_in_buffer()) {
-            char c = get_key_from_buffer();
-            
-            if (c == 'q' || c == 'Q') {
-                exit = 1;
-                break;
-            }
+        // Asleep until a key comes in; the spinner and shell get the CPU meanwhile
+        char c = keyboard_getchar();
+        if (c == 'q' || c == 'Q') {
+            exit = 1;
+            break;
+        }
 
-            // Save old coordinates to erase them
-            old_x = x;
-            old_y = y;
+        // Save old coordinates to erase them
+        old_x = x;
+        old_y = y;
 
-            switch (c) {  
-                case 'w': y -= 8; break;
-                case 's': y += 8; break;
-                case 'a': x -= 8; break;
-                case 'd': x += 8; break;
-            }
-
-            // 3. Optimized Rendering
-            vesa_updating = 1;
-            
-            // Wipe ONLY the 8x8 pixels of the previous position
-            VESA_clear_region(old_x, old_y, 8, 8);
-            
-            // Draw new position
-            VESA_draw_char('*', x, y, 0x00FFFF);
-
-            // TIGHTEN the metadata box so 'KILL' only wipes the current player
-            task_list[current_task_idx].first_x = x;
-            task_list[current_task_idx].first_y = y;
-            task_list[current_task_idx].last_x = x + 8;
-            task_list[current_task_idx].last_y = y + 8;
-
-            vesa_updating = 0;
-            VESA_flip(); 
-        } else {
-            // Stay polite! Let the spinner and shell logic breathe
-            yield();
+        switch (c) {  
+            case 'w': y -= 8; break;
+            case 's': y += 8; break;
+            case 'a': x -= 8; break;
+            case 'd': x += 8; break;
         }
+
+        // 3. Optimized Rendering
+        vesa_updating = 1;
+        
+        // Wipe ONLY the 8x8 pixels of the previous position
+        VESA_clear_region(old_x, old_y, 8, 8);
+        
+        // Draw new position
+        VESA_draw_char('*', x, y, 0x00FFFF);
+
+        // TIGHTEN the metadata box so 'KILL' only wipes the current player
+        current_task->first_x = x;
+        current_task->first_y = y;
+        current_task->last_x = x + 8;
+        current_task->last_y = y + 8;
+
+        vesa_updating = 0;
+        VESA_flip(); 
     }
 
     // 4. Exit Cleanup
     vesa_updating = 1;
     VESA_clear(); // Clear the game screen before returning to shell
     vesa_updating = 0;
-    keyboard_focus_tid = previous_focus;
+    keyboard_set_focus(previous_focus);
     // Reset Shell cursor to top-left so the prompt looks right
     vesa_cursor_x = 0;
     vesa_cursor_y = 0;
 }
+// A number followed by spaces up to 'width' (kprintf has no %-Nd)
+static void top_column(uint32_t val, int width) {
+    char buf[16];
+    itoa(val, buf, 10);
+    kprintf_unsync("%s", buf);
+    for (int j = kstrlen(buf); j < width; j++) kprintf_unsync(" ");
+}
+
 void run_top() {
 int previous_focus = keyboard_focus_tid;
-    keyboard_focus_tid = current_task_idx;
+    keyboard_set_focus(current_task_idx);
 
 // 1. CLEAR the keyboard buffer so we don't process old keys
     while (has_key_in_buffer()) {
@@ -307,6 +589,8 @@ int previous_focus = keyboard_focus_tid;
     }
     // Initial clear
     VESA_clear();
+    uint64_t last_sample = 0;
+    int first = 1;
     
     while (1) {
         // Move cursor to 0,0 or clear
@@ -314,46 +598,70 @@ int previous_focus = keyboard_focus_tid;
         VESA_clear_buffer_only();
 
 
+        // Rates are over the time since the last frame (since boot on the first)
+        uint64_t now = clock_ns();
+        uint32_t wall_us = (uint32_t)div64_32(now - last_sample, 1000);
+        if (!wall_us) wall_us = 1;
+
         kprintf_unsync("KDXOS TOP - System Ticks: %d\n", system_ticks);
         kprintf_unsync("Press 'q' to return to Shell\n");
-        kprintf_unsync("-------------------------------------------\n");
-        kprintf_unsync("TID   NAME         STATE      CPU-TICKS\n");
+        kprintf_unsync("-----------------------------------------------------------------------\n");
+        kprintf_unsync("TID   NAME         STATE      PRI  %%CPU   CPU-MS    SW/S   VOL     INVOL   WAIT-MS\n");
 
-        for (int i = 0; i < MAX_TASKS; i++) {
-            if (task_get_state(i) != 0) {
+        for (struct task* t = task_iter(NULL); t; t = task_iter(t)) {
+            int i = t->tid;
+            if (t->state != 0) {
                 // Print TID and Name
-                kprintf_unsync("%d     %s", i, task_get_name(i));
+                kprintf_unsync("%d     %s", i, t->name);
 
                 // Manual Padding for Name Column (since no %-13s)
-                int name_len = kstrlen(task_get_name(i));
+                int name_len = kstrlen(t->name);
                 for (int j = 0; j < (13 - name_len); j++) kprintf_unsync(" ");
 
                 // Print State
-                if (task_get_state(i) == 1)      kprintf_unsync("READY      ");
-                else if (task_get_state(i) == 2) kprintf_unsync("SLEEP      ");
-
-                // Print Ticks (We added this field to the task struct earlier)
-                kprintf_unsync("%d\n", task_get_total_ticks(i));
+                if (t->state == 1)      kprintf_unsync("READY      ");
+                else if (t->state == 2) kprintf_unsync("SLEEP      ");
+                else if (t->state == TASK_ZOMBIE) kprintf_unsync("ZOMBIE     ");
+                top_column(t->priority, 5);
+
+                // What it really ran since the last frame, to the nanosecond
+                uint64_t run = sched_runtime_ns(t);
+                uint64_t ran = first ? run : run - t->top_run_ns;
+                uint32_t switches = t->nvcsw + t->nivcsw;
+                uint32_t switched = first ? switches : switches - t->top_switches;
+                t->top_run_ns = run;
+                t->top_switches = switches;
+
+                uint32_t pct10 = (uint32_t)div64_32(div64_32(ran, 1000) * 1000, wall_us);
+                char buf[16];
+                itoa(pct10 / 10, buf, 10);
+                int len = kstrlen(buf);
+                kprintf_unsync("%s.%d", buf, pct10 % 10);
+                for (int j = len + 2; j < 7; j++) kprintf_unsync(" ");
+
+                top_column((uint32_t)div64_32(run, NS_PER_MS), 10);
+                top_column((uint32_t)div64_32((uint64_t)switched * 1000000, wall_us), 7);
+                top_column(t->nvcsw, 8);
+                top_column(t->nivcsw, 8);
+                kprintf_unsync("%d\n", (uint32_t)div64_32(t->wait_ns, NS_PER_MS));
             }
         }
+        last_sample = now;
+        first = 0;
         vesa_updating = 0;         // Unlock
         VESA_flip();               // Show finished frame
 
 
-        // --- NON-BLOCKING CHECK ---
-        // We use your io.c functions here
-        if (has_key_in_buffer()) {
-            char c = get_key_from_buffer(); 
-            if (c == 'q' || c == 'Q') {
-                break; // Exit the loop
-            }
+        // Redraw every 500ms, or right away on a key; asleep in between
+        char c = keyboard_getchar_timeout(500);
+        if (c == 'q' || c == 'Q') {
+            break; // Exit the loop
         }
-               sleep(500); 
     }
     
     VESA_clear_buffer_only();
 
-    keyboard_focus_tid = previous_focus;
+    keyboard_set_focus(previous_focus);
     kprintf_unsync("Returned to Shell.\n");
   VESA_flip();
 }
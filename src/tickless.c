@@ -0,0 +1,137 @@
+#include "tickless.h"
+#include "timer.h"
+#include "idt.h"
+#include "io.h"
+#include "lib.h"
+#include "vesa.h"
+
+int tickless_enabled = 1;
+
+static volatile int active = 0; // Read by the APs too (smp_kick_boot_cpu)
+static uint32_t shot_counts = 0;    // PIT counts the current one-shot was loaded with
+static uint32_t shot_first = 0;     // Counts from arming to the first tick boundary
+static uint32_t shot_accounted = 0; // Ticks of this shot already handed out
+
+static uint32_t shots = 0;
+static uint32_t ticks_skipped = 0;
+static uint32_t kicks = 0;          // Shots cut short by a wakeup
+
+static uint32_t pit_divisor() {
+    return PIT_HZ / timer_frequency;
+}
+
+// Latches channel 0 and reads back its current count
+static uint32_t pit_read_count() {
+    outb(0x43, 0x00);
+    uint32_t lo = inb(0x40);
+    uint32_t hi = inb(0x40);
+    return (hi << 8) | lo;
+}
+
+// Read-back status of channel 0: OUT goes high once a mode 0 count hits zero
+static int pit_shot_done() {
+    outb(0x43, 0xE2);
+    return inb(0x40) & 0x80;
+}
+
+static void pit_oneshot(uint32_t counts) {
+    outb(0x43, 0x30); // Channel 0, lo/hi byte, mode 0
+    outb(0x40, (uint8_t)(counts & 0xFF));
+    outb(0x40, (uint8_t)((counts >> 8) & 0xFF));
+}
+
+int tickless_active() {
+    return active;
+}
+
+/**
+ * Called by schedule() whenever it hands the CPU to the idle task.
+ * Swaps the periodic tick for a one-shot that ends on the tick boundary
+ * the wheel next needs, so the PIT keeps its phase.
+ */
+void tickless_enter() {
+    if (active || !tickless_enabled) return;
+
+    uint32_t div = pit_divisor();
+    uint32_t first = pit_read_count(); // Mode 2: counts left until the next tick
+    // Too close to the tick: its IRQ may already be on the way
+    if (first == 0 || first > div || first < div / 8) return;
+
+    uint32_t max = 1 + (0xFFFF - first) / div;
+    uint32_t ticks = timer_idle_ticks(max);
+    if (ticks <= 1) return;
+
+    // Nothing draws while idle, so get the last frame out before the
+    // periodic flips stop
+    VESA_flip();
+
+    shot_counts = first + (ticks - 1) * div;
+    shot_first = first;
+    shot_accounted = 0;
+    active = 1;
+    pit_oneshot(shot_counts);
+
+    shots++;
+    ticks_skipped += ticks - 1;
+}
+
+/**
+ * Timer IRQ side: returns how many tick boundaries went by since the
+ * last call, worked out from the counter rather than by counting IRQs.
+ * Once the shot has run out, the PIT goes back to periodic mode.
+ */
+uint32_t tickless_sync() {
+    if (!active) return 1;
+
+    uint32_t div = pit_divisor();
+    int done = pit_shot_done();
+    uint32_t elapsed;
+    if (done) {
+        elapsed = shot_counts;
+    } else {
+        uint32_t left = pit_read_count();
+        elapsed = (left < shot_counts) ? shot_counts - left : 0;
+    }
+
+    uint32_t ticks = (elapsed >= shot_first) ? 1 + (elapsed - shot_first) / div : 0;
+    uint32_t fresh = ticks - shot_accounted;
+    shot_accounted = ticks;
+
+    if (done) {
+        active = 0;
+        timer_init(timer_frequency); // Shot ended on a boundary: phase carries on
+    }
+    return fresh;
+}
+
+/**
+ * Something other than the timer just made a task runnable while we're
+ * idling in a one-shot. Re-arm it to end on the very next tick boundary,
+ * where tickless_sync() picks up as usual and the scheduler runs.
+ * Interrupts are off.
+ */
+void tickless_kick() {
+    if (!active || pit_shot_done()) return;
+
+    uint32_t div = pit_divisor();
+    uint32_t left = pit_read_count();
+    uint32_t elapsed = (left < shot_counts) ? shot_counts - left : 0;
+
+    // First boundary still ahead of us
+    uint32_t boundary = shot_first;
+    if (elapsed >= shot_first) boundary += (1 + (elapsed - shot_first) / div) * div;
+    if (boundary >= shot_counts) return; // That's where the shot ends anyway
+
+    // Reloading restarts the count, so shot_counts - left stays 'elapsed'
+    shot_counts = boundary;
+    pit_oneshot(boundary - elapsed);
+    kicks++;
+}
+
+void tickless_print_stats() {
+    kprintf_unsync("Tickless idle: %s\n", tickless_enabled ? "ON" : "OFF");
+    kprintf_unsync("  One-shots armed : %d\n", shots);
+    kprintf_unsync("  Ticks skipped   : %d\n", ticks_skipped);
+    kprintf_unsync("  Woken early     : %d\n", kicks);
+    kprintf_unsync("  Max shot        : %d ticks\n", 0xFFFF / pit_divisor());
+}
@@ -0,0 +1,165 @@
+#include "timer.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+// A slot is a circular list headed by a dummy node
+struct timer_slot {
+    struct timer head;
+};
+
+static struct timer_slot root[TIMER_ROOT_SIZE];
+static struct timer_slot levels[4][TIMER_LEVEL_SIZE];
+static uint32_t wheel_time = 1; // Next tick the wheel will process (tick 0 is boot)
+static int wheel_ready = 0;
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+static void wheel_init() {
+    for (int i = 0; i < TIMER_ROOT_SIZE; i++) {
+        root[i].head.next = root[i].head.prev = &root[i].head;
+    }
+    for (int l = 0; l < 4; l++) {
+        for (int i = 0; i < TIMER_LEVEL_SIZE; i++) {
+            levels[l][i].head.next = levels[l][i].head.prev = &levels[l][i].head;
+        }
+    }
+    wheel_ready = 1;
+}
+
+static void slot_append(struct timer_slot* s, struct timer* t) {
+    t->next = &s->head;
+    t->prev = s->head.prev;
+    s->head.prev->next = t;
+    s->head.prev = t;
+}
+
+static void slot_unlink(struct timer* t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+// Which level/slot 'expires' belongs in, seen from wheel_time
+static void wheel_insert(struct timer* t) {
+    uint32_t expires = t->expires;
+    uint32_t delta = expires - wheel_time;
+    struct timer_slot* s;
+
+    if ((int32_t)delta < 0) {
+        s = &root[wheel_time & (TIMER_ROOT_SIZE - 1)]; // Already due: next tick
+    } else if (delta < (1u << TIMER_ROOT_BITS)) {
+        s = &root[expires & (TIMER_ROOT_SIZE - 1)];
+    } else {
+        int l = 0;
+        uint32_t shift = TIMER_ROOT_BITS;
+        while (l < 3 && delta >= (1u << (shift + TIMER_LEVEL_BITS))) {
+            l++;
+            shift += TIMER_LEVEL_BITS;
+        }
+        s = &levels[l][(expires >> shift) & (TIMER_LEVEL_SIZE - 1)];
+    }
+    slot_append(s, t);
+}
+
+// Re-files every timer of one upper slot; returns the slot index
+static uint32_t cascade(int l) {
+    uint32_t shift = TIMER_ROOT_BITS + l * TIMER_LEVEL_BITS;
+    uint32_t index = (wheel_time >> shift) & (TIMER_LEVEL_SIZE - 1);
+    struct timer_slot* s = &levels[l][index];
+
+    struct timer* t = s->head.next;
+    s->head.next = s->head.prev = &s->head;
+    while (t != &s->head) {
+        struct timer* next = t->next;
+        wheel_insert(t);
+        t = next;
+    }
+    return index;
+}
+
+void timer_setup(struct timer* t, void (*fn)(void* arg), void* arg) {
+    t->fn = fn;
+    t->arg = arg;
+    t->next = t->prev = NULL;
+    t->pending = 0;
+}
+
+/**
+ * Arms (or re-arms) 't' to fire 'ticks' ticks from now. Zero means on
+ * the next tick.
+ */
+void timer_add(struct timer* t, uint32_t ticks) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    if (!wheel_ready) wheel_init();
+    if (t->pending) slot_unlink(t);
+    t->expires = wheel_time - 1 + ticks; // wheel_time - 1 is "now"
+    wheel_insert(t);
+    t->pending = 1;
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// Returns 1 if the timer was still pending
+int timer_cancel(struct timer* t) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    int was_pending = t->pending;
+    if (was_pending) {
+        slot_unlink(t);
+        t->pending = 0;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return was_pending;
+}
+
+uint32_t timer_remaining(struct timer* t) {
+    if (!t->pending) return 0;
+    uint32_t left = t->expires - (wheel_time - 1);
+    return ((int32_t)left < 0) ? 0 : left;
+}
+
+/**
+ * How many ticks from now the wheel can be left alone, at most 'max'.
+ * Only the root slots are looked at; a root wrap counts as work because
+ * the cascade may bring something due right then.
+ */
+uint32_t timer_idle_ticks(uint32_t max) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    if (!wheel_ready) wheel_init();
+
+    uint32_t d = 1;
+    for (; d < max; d++) {
+        uint32_t index = (wheel_time + d - 1) & (TIMER_ROOT_SIZE - 1);
+        if (index == 0 || root[index].head.next != &root[index].head) break;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return d;
+}
+
+/**
+ * Called from the timer IRQ after system_ticks moved to 'now'. Catches
+ * the wheel up and runs whatever expired.
+ */
+void timer_tick(uint32_t now) {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+    if (!wheel_ready) wheel_init();
+
+    while ((int32_t)(now - wheel_time) >= 0) {
+        uint32_t index = wheel_time & (TIMER_ROOT_SIZE - 1);
+
+        // Root wrapped: pull the next slot of each level down, as far as needed
+        if (index == 0) {
+            for (int l = 0; l < 4 && cascade(l) == 0; l++);
+        }
+
+        struct timer_slot* s = &root[index];
+        wheel_time++;
+        while (s->head.next != &s->head) {
+            struct timer* t = s->head.next;
+            slot_unlink(t);
+            t->pending = 0;
+            // Callbacks may re-arm themselves or others, so drop the lock
+            spin_unlock(&timer_lock);
+            t->fn(t->arg);
+            spin_lock(&timer_lock);
+        }
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
@@ -0,0 +1,71 @@
+; --- AP startup trampoline ---
+; smp.c copies everything between ap_trampoline_start and ap_trampoline_end
+; to AP_TRAMPOLINE (0x8000) and fills in the ap_tramp_* slots, then sends
+; INIT/SIPI. The AP wakes up in real mode at 0800:0000.
+
+AP_TRAMPOLINE equ 0x8000
+%define TRAMP(x) ((x) - ap_trampoline_start + AP_TRAMPOLINE)
+
+section .text
+bits 16
+
+global ap_trampoline_start
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [TRAMP(ap_gdt_ptr)]
+
+    mov eax, cr0
+    or eax, 1               ; PE
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(ap_pmode)
+
+bits 32
+ap_pmode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Same paging setup as the boot CPU: CR4 (PSE, OSFXSR) before PG
+    mov eax, [TRAMP(ap_tramp_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMP(ap_tramp_cr3)]
+    mov cr3, eax
+    mov eax, [TRAMP(ap_tramp_cr0)]
+    mov cr0, eax
+
+    mov esp, [TRAMP(ap_tramp_stack)]
+    mov eax, [TRAMP(ap_tramp_entry)]
+    call eax                ; ap_main, never returns
+.hang:
+    hlt
+    jmp .hang
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF   ; 0x08: flat code
+    dq 0x00CF92000000FFFF   ; 0x10: flat data
+ap_gdt_ptr:
+    dw 23
+    dd TRAMP(ap_gdt)
+
+align 4
+global ap_tramp_cr0
+global ap_tramp_cr3
+global ap_tramp_cr4
+global ap_tramp_stack
+global ap_tramp_entry
+ap_tramp_cr0:   dd 0
+ap_tramp_cr3:   dd 0
+ap_tramp_cr4:   dd 0
+ap_tramp_stack: dd 0
+ap_tramp_entry: dd 0
+
+global ap_trampoline_end
+ap_trampoline_end:
@@ -2,19 +2,22 @@
 #include "kheap.h"
 #include "lib.h"
 #include "task.h"
+#include "paging.h"
+#include "cpu.h"
+#include "smp.h"
 
-extern struct task task_list[];
 static struct multiboot_info* boot_info = 0;
 int vesa_cursor_x = 0;
 int vesa_cursor_y = 0;
 int vesa_dirty = 0;
 int vesa_updating = 0; // The LOCK: 1 = Busy drawing, 0 = Safe to flip
-extern int current_task_idx;
 static uint32_t* back_buffer = NULL;
 static uint32_t total_pixels = 0;
 static uint32_t screen_width = 0;
 
 uint32_t target_fps = 30; // Global target, default to 30
+static int vesa_wc = 0;          // 1 = framebuffer mapped write-combining
+static int vesa_wc_mtrr = -1;    // MTRR slot we borrowed when there is no PAT
 
 void VESA_set_fps(uint32_t fps) {
     if (fps == 0) fps = 1;    // Prevent division by zero
@@ -42,9 +45,63 @@ void VESA_init(struct multiboot_info* mbi) {
     back_buffer = (uint32_t*)kmalloc(total_pixels * 4);
     if (!back_buffer) return;
 
+    // Flips only ever write VRAM, in big sequential bursts: exactly what
+    // write-combining is for.
+    VESA_set_write_combining(1);
+
     VESA_clear();
 }
 
+/**
+ * Maps VRAM write-combining (1) or back to the default write-back (0).
+ * Uses PAT when the CPU has it, a spare MTRR otherwise.
+ * Returns 0 on success, -1 if neither mechanism is available.
+ */
+int VESA_set_write_combining(int enable) {
+    uint32_t fb = (uint32_t)boot_info->framebuffer_addr;
+    uint32_t size = boot_info->framebuffer_pitch * boot_info->framebuffer_height;
+
+    if (paging_set_write_combining(fb, size, enable) == 0) {
+        vesa_wc = enable;
+        return 0;
+    }
+
+    // MTRRs are per CPU and the APs copied ours when they booted;
+    // changing only this CPU's now would leave them disagreeing
+    if (cpu_count > 1) return -1;
+
+    if (enable) {
+        if (vesa_wc_mtrr < 0) vesa_wc_mtrr = mtrr_set_wc(fb, size);
+        if (vesa_wc_mtrr < 0) return -1;
+    } else {
+        mtrr_clear(vesa_wc_mtrr);
+        vesa_wc_mtrr = -1;
+    }
+    vesa_wc = enable;
+    return 0;
+}
+
+int VESA_get_write_combining() {
+    return vesa_wc;
+}
+
+/**
+ * Average TSC cycles for one full back buffer -> VRAM copy.
+ * Times the raw copy so it works even while vesa_updating is held.
+ */
+uint32_t VESA_time_flip(int rounds) {
+    if (!back_buffer || rounds <= 0) return 0;
+
+    uint32_t* vram = (uint32_t*)(uintptr_t)boot_info->framebuffer_addr;
+    uint32_t total = 0;
+    for (int i = 0; i < rounds; i++) {
+        uint64_t t0 = rdtsc();
+        kmemcpy32(vram, back_buffer, total_pixels);
+        total += (uint32_t)(rdtsc() - t0);
+    }
+    return total / rounds;
+}
+
 /**
  * Silent clear: RAM only.
  */
@@ -92,9 +149,8 @@ void VESA_draw_char(char c, int x, int y, uint32_t color) {
         y + 8 > (int)boot_info->framebuffer_height) return;
 
     // 2. Metadata tracking (Skip for Shell/Task 0)
-    // We use a local pointer to avoid repeated indexing into the volatile array
-    if (current_task_idx > 0 && current_task_idx < MAX_TASKS) {
-        volatile struct task* cur = &task_list[current_task_idx];
+    if (current_task_idx > 0 && current_task) {
+        struct task* cur = current_task;
         
         if (!cur->has_drawn) {
             cur->first_x = x;
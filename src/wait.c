@@ -0,0 +1,106 @@
+#include "wait.h"
+#include "task.h"
+#include "sched.h"
+#include "tickless.h"
+#include "smp.h"
+#include <stddef.h>
+
+void wait_queue_init(struct wait_queue* wq) {
+    wq->lock = SPINLOCK_INIT;
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// Caller holds wq->lock
+static void wq_unlink(struct wait_queue* wq, struct task* t) {
+    if (t->wait_prev) t->wait_prev->wait_next = t->wait_next;
+    else wq->head = t->wait_next;
+    if (t->wait_next) t->wait_next->wait_prev = t->wait_prev;
+    else wq->tail = t->wait_prev;
+    t->wait_next = t->wait_prev = NULL;
+    t->waiting_on = NULL;
+}
+
+/**
+ * Queues the current task on 'wq' and marks it SLEEPING. It keeps the CPU
+ * until it yields; a wake_up before then just makes it READY again.
+ */
+void wait_prepare(struct wait_queue* wq) {
+    struct task* t = current_task;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    if (t->state == TASK_ZOMBIE) {
+        spin_unlock_irqrestore(&wq->lock, flags);
+        return;
+    }
+    if (t->waiting_on != wq) {
+        t->wait_next = NULL;
+        t->wait_prev = wq->tail;
+        if (wq->tail) wq->tail->wait_next = t;
+        else wq->head = t;
+        wq->tail = t;
+        t->waiting_on = wq;
+    }
+    t->state = TASK_SLEEPING;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Done waiting (event seen or gave up): off the queue and READY, unless dead
+void wait_finish(struct wait_queue* wq) {
+    struct task* t = current_task;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    if (t->waiting_on == wq) wq_unlink(wq, t);
+    if (t->state != TASK_ZOMBIE) t->state = TASK_READY;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Pulls a dying task off whatever it was waiting on
+void wait_remove(struct task* t) {
+    struct wait_queue* wq = t->waiting_on;
+    if (!wq) return;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    if (t->waiting_on == wq) wq_unlink(wq, t);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * A wakeup from an IRQ lands while the boot CPU may be sitting in a long
+ * tickless one-shot; cut it short so the woken task runs within a tick.
+ * From an AP that takes an IPI.
+ */
+static void wake_kick(int woken) {
+    if (!woken) return;
+    if (cpu_id() == 0) tickless_kick();
+    else smp_kick_boot_cpu();
+}
+
+// Wakes every waiter. Returns how many there were.
+int wake_up(struct wait_queue* wq) {
+    int woken = 0;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    while (wq->head) {
+        struct task* t = wq->head;
+        wq_unlink(wq, t);
+        sched_wake(t->tid);
+        woken++;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    wake_kick(woken);
+    return woken;
+}
+
+// Wakes just 'tid' if it is waiting here; the rest stay asleep
+int wake_up_tid(struct wait_queue* wq, int tid) {
+    int woken = 0;
+    uint32_t flags = spin_lock_irqsave(&wq->lock);
+    for (struct task* t = wq->head; t; t = t->wait_next) {
+        if (t->tid == tid) {
+            wq_unlink(wq, t);
+            sched_wake(tid);
+            woken = 1;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    wake_kick(woken);
+    return woken;
+}